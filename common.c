@@ -5,10 +5,111 @@
 // supporting functions
 #include "common.h"
 
+// set by the kernel at boot when the hart has the V extension. user space
+// never sets it and always uses the word-wide versions.
+// kept out of .bss: the kernel clears .bss with memset before anything else.
+__attribute__((section(".data"))) bool mem_use_rvv = false;
+
+// vector copy: each pass moves as many bytes as one LMUL=8 register group
+// holds, vsetvli takes care of the tail. the vector unit is only switched on
+// for the copy; the kernel never traps or sleeps in here.
+void *memcpy_rvv(void *dst, const void *src, size_t n) {
+  void *d = dst;
+  __asm__ __volatile__(".option push\n"
+                       ".option arch, +v\n"
+                       "csrs sstatus, %[vs_on]\n"
+                       "1:\n"
+                       "vsetvli t0, %[n], e8, m8, ta, ma\n"
+                       "vle8.v v0, (%[s])\n"
+                       "vse8.v v0, (%[d])\n"
+                       "add %[s], %[s], t0\n"
+                       "add %[d], %[d], t0\n"
+                       "sub %[n], %[n], t0\n"
+                       "bnez %[n], 1b\n"
+                       "csrc sstatus, %[vs]\n"
+                       ".option pop\n"
+                       : [d] "+r"(d), [s] "+r"(src), [n] "+r"(n)
+                       : [vs_on] "r"(SSTATUS_VS_INITIAL), [vs] "r"(SSTATUS_VS)
+                       : "t0", "memory");
+  return dst;
+}
+
+// vector fill, same strip-mining loop as memcpy_rvv
+void *memset_rvv(void *buf, char c, size_t n) {
+  void *p = buf;
+  __asm__ __volatile__(".option push\n"
+                       ".option arch, +v\n"
+                       "csrs sstatus, %[vs_on]\n"
+                       "vsetvli t0, zero, e8, m8, ta, ma\n"
+                       "vmv.v.x v0, %[c]\n"
+                       "1:\n"
+                       "vsetvli t0, %[n], e8, m8, ta, ma\n"
+                       "vse8.v v0, (%[p])\n"
+                       "add %[p], %[p], t0\n"
+                       "sub %[n], %[n], t0\n"
+                       "bnez %[n], 1b\n"
+                       "csrc sstatus, %[vs]\n"
+                       ".option pop\n"
+                       : [p] "+r"(p), [n] "+r"(n)
+                       : [c] "r"(c), [vs_on] "r"(SSTATUS_VS_INITIAL),
+                         [vs] "r"(SSTATUS_VS)
+                       : "t0", "memory");
+  return buf;
+}
+
 // copies n bytes from src->dst
+// bytes until dst is word aligned, then whole words, then the tail bytes.
+// when src ends up misaligned against dst we still only do aligned loads and
+// shift neighbouring words together (little endian), since misaligned
+// accesses trap to the SBI on most harts.
 void *memcpy(void *dst, const void *src, size_t n) {
+  if (mem_use_rvv)
+    return memcpy_rvv(dst, src, n);
+
   uint8_t *d = (uint8_t *)dst;
   const uint8_t *s = (const uint8_t *)src;
+  if (n < 2 * sizeof(uint32_t))
+    goto tail;
+
+  while (!is_aligned(d, sizeof(uint32_t))) {
+    *d++ = *s++;
+    n--;
+  }
+
+  uint32_t *dw = (uint32_t *)d;
+  unsigned shift = ((uint32_t)s % sizeof(uint32_t)) * 8;
+  if (shift == 0) {
+    const uint32_t *sw = (const uint32_t *)s;
+    while (n >= 4 * sizeof(uint32_t)) {
+      dw[0] = sw[0];
+      dw[1] = sw[1];
+      dw[2] = sw[2];
+      dw[3] = sw[3];
+      dw += 4;
+      sw += 4;
+      n -= 4 * sizeof(uint32_t);
+    }
+    while (n >= sizeof(uint32_t)) {
+      *dw++ = *sw++;
+      n -= sizeof(uint32_t);
+    }
+    s = (const uint8_t *)sw;
+  } else {
+    // every aligned word we load holds at least one byte we copy, so this
+    // never reads past the page the source ends in
+    const uint32_t *sw = (const uint32_t *)(s - shift / 8);
+    uint32_t lo = *sw++;
+    while (n >= sizeof(uint32_t)) {
+      uint32_t hi = *sw++;
+      *dw++ = (lo >> shift) | (hi << (32 - shift));
+      lo = hi;
+      n -= sizeof(uint32_t);
+    }
+    s = (const uint8_t *)sw - sizeof(uint32_t) + shift / 8;
+  }
+  d = (uint8_t *)dw;
+
+tail:
   while (n--)
     *d++ = *s++;
   return dst;
@@ -16,8 +117,35 @@ void *memcpy(void *dst, const void *src, size_t n) {
 
 // set memory starting at buf to value c until buf+n
 // buf[cccccccccccccccc]buf+n
+// bytes until buf is word aligned, then whole words, then the tail bytes
 void *memset(void *buf, char c, size_t n) {
+  if (mem_use_rvv)
+    return memset_rvv(buf, c, n);
+
   uint8_t *p = (uint8_t *)buf;
+  if (n >= 2 * sizeof(uint32_t)) {
+    while (!is_aligned(p, sizeof(uint32_t))) {
+      *p++ = c;
+      n--;
+    }
+
+    uint32_t word = (uint8_t)c * 0x01010101u;
+    uint32_t *pw = (uint32_t *)p;
+    while (n >= 4 * sizeof(uint32_t)) {
+      pw[0] = word;
+      pw[1] = word;
+      pw[2] = word;
+      pw[3] = word;
+      pw += 4;
+      n -= 4 * sizeof(uint32_t);
+    }
+    while (n >= sizeof(uint32_t)) {
+      *pw++ = word;
+      n -= sizeof(uint32_t);
+    }
+    p = (uint8_t *)pw;
+  }
+
   while (n--)
     *p++ = c;
   return buf;
@@ -80,6 +208,9 @@ void printf(const char *fmt, ...) {
         }
         break;
       }
+      case 'c': // Print a single character.
+        putchar((char)va_arg(vargs, int));
+        break;
       case 'd': { // Print an integer in decimal.
         int value = va_arg(vargs, int);
         unsigned magnitude =
@@ -21,20 +21,54 @@ typedef uint32_t vaddr_t;
 #define SYS_PUTCHAR 1
 #define SYS_GETCHAR 2
 #define SYS_EXIT 3
+#define SYS_NICE 4
+#define SYS_SYNC 5
+#define SYS_BCACHE_STATS 6
+#define SYS_MMAP 7
+#define SYS_WRITE 8
+#define SYS_DMESG 9
+#define SYS_READ 10
+#define SYS_NULL 11
+#define SYS_FAULT_STATS 12
+#define SYS_SPAWN 13
+#define SYS_WAIT 14
+#define SYS_FREAD 15
+#define SYS_FWRITE 16
+#define SYS_MAX 17 // one past the highest syscall number
 // globals
 
 extern char __free_ram[], __free_ram_end[];
 
 // virtio
 #define VIRTIO_BLK_PADDR 0x10001000
+#define UART_PADDR 0x10000000
+// interrupt controller. it spans more than 4MB on qemu virt, but the
+// registers we touch (see kernel.h) all lie in the first 4MB megapage.
+#define PLIC_PADDR 0x0c000000
 
 // page table macros
 #define SATP_SV32 (1u << 31)
+#define SATP_ASID_SHIFT 22 // Sv32 address space ID, up to 9 bits
+#define SATP_ASID_MASK 0x1ff
 #define PAGE_V (1 << 0) // "Valid" bit (entry is enabled)
 #define PAGE_R (1 << 1) // Readable
 #define PAGE_W (1 << 2) // Writable
 #define PAGE_X (1 << 3) // Executable
 #define PAGE_U (1 << 4) // User (accessible in user mode)
+#define PAGE_G (1 << 5) // Global (same in every address space, kept across ASIDs)
+#define PAGE_COW (1 << 8)    // RSW: private page, copied on the first write
+#define PAGE_SHARED (1 << 9) // RSW: not owned by the process, never freed with it
+
+// vector unit state in sstatus, read-only zero without the V extension. the
+// unit is off except inside memcpy_rvv/memset_rvv, so user mode can never
+// see what the kernel left in the vector registers.
+#define SSTATUS_VS (3 << 9)
+#define SSTATUS_VS_INITIAL (1 << 9) // enabled, nothing to save
+
+// mmap protections. writable mappings are always private copy-on-write.
+#define PROT_READ (1 << 0)
+#define PROT_WRITE (1 << 1)
+#define PROT_EXEC (1 << 2)
 
 // other macros
 
@@ -52,12 +86,29 @@ extern char __free_ram[], __free_ram_end[];
 #define PANIC(fmt, ...)                                                        \
   do {                                                                         \
     printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);      \
+    flush();                                                                   \
     while (1) {                                                                \
     }                                                                          \
   } while (0)
 
 // structures
 
+// page fault counters of a process, returned by SYS_FAULT_STATS
+struct fault_stats {
+  uint32_t major; // pages whose contents had to be produced (copied or read)
+  uint32_t minor; // pages that were in memory and only had to be mapped
+};
+
+// buffer cache counters, returned by SYS_BCACHE_STATS
+struct bcache_stats {
+  uint32_t hits;       // lookups that found the sector cached
+  uint32_t misses;     // lookups that had to allocate a buffer
+  uint32_t evictions;  // buffers recycled for another sector
+  uint32_t writebacks; // dirty buffers written to disk
+  uint32_t buffers;    // buffers currently allocated
+  uint32_t dirty;      // buffers waiting for write-back
+};
+
 // struct sbiret {
 //   long error;
 //   long value;
@@ -74,6 +125,9 @@ extern paddr_t alloc_pages(uint32_t n);
 extern void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t);
 // flags);
 
+// use the RISC-V vector versions of memcpy/memset (kernel only)
+extern bool mem_use_rvv;
+
 // sets an area of memory to a certain character c
 void *memset(void *buf, char c, size_t n);
 // copies from dst to src of size n, unsafe
@@ -89,4 +143,5 @@ int strcmp(const char *s1, const char *s2);
 
 // some functions for text output
 void putchar(char ch);
+void flush(void); // push buffered putchar output to the console
 void printf(const char *fmt, ...);
@@ -0,0 +1,47 @@
+#ifndef ELF_H_
+#define ELF_H_
+
+#include "common.h"
+
+#define ELF_MAGIC 0x464c457f // "\x7fELF", read as a little endian word
+#define ELFCLASS32 1
+#define ET_EXEC 2
+#define EM_RISCV 243
+#define PT_LOAD 1
+#define PF_X (1 << 0)
+#define PF_W (1 << 1)
+#define PF_R (1 << 2)
+
+struct elf_header {
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t ident_version;
+    uint8_t ident_pad[9];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t phoff;  // Offset of the program header table
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed));
+
+struct elf_phdr {
+    uint32_t type;
+    uint32_t offset; // Where the segment's bytes start in the file
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz; // Bytes taken from the file, the rest is zero
+    uint32_t memsz;
+    uint32_t flags;  // PF_*
+    uint32_t align;
+} __attribute__((packed));
+
+#endif // ELF_H_
@@ -1,8 +1,8 @@
 #ifndef FILESYSTEM_H_
 #define FILESYSTEM_H_
 
-#define FILES_MAX 4
-#define DISK_MAX_SIZE align_up(sizeof(struct file) * FILES_MAX, SECTOR_SIZE)
+#define FS_EXTENT_PAGES 16 // largest in-memory extent a file grows by
+#define FS_MAP_MAX_PAGES (PAGE_SIZE / sizeof(paddr_t)) // per mapped file
 
 struct tar_header {
     char name[100];
@@ -26,11 +26,24 @@ struct tar_header {
                  // (flexible array member)
 } __attribute__((packed));
 
+// a run of file content, either on disk or in pages that have not been
+// written out yet. a file's extents cover it back to back.
+struct extent {
+    struct extent *next;
+    unsigned sector; // First disk sector, when page is 0
+    paddr_t page;    // Or the pages holding the data
+    uint32_t bytes;  // Bytes covered: sectors or pages times their size
+};
+
 struct file {
-    bool in_use;     // Indicates if this file entry is in use
-    char name[100];  // File name
-    char data[1024]; // File content
-    size_t size;     // File size
+    bool in_use;            // Indicates if this file entry is in use
+    char name[100];         // File name
+    size_t size;            // File size
+    unsigned sector;        // Sector of the tar header on disk
+    struct extent *extents; // File content
+    bool header_dirty;      // Size changed since the last fs_flush
+    int hash_next;          // Next index on the same name hash chain, or -1
+    paddr_t *page_cache;    // Pages of content for mmap, 0 if not read yet
 };
 
 #endif // FILESYSTEM_H_
@@ -1,6 +1,7 @@
 #include "kernel.h"
 #include "common.h"
 #include "filesystem.h"
+#include "memory.h"
 #include "process.h"
 
 // bunch of externs to work with memory
@@ -8,11 +9,13 @@ extern char __kernel_base[];
 extern char __stack_top[];
 extern char __bss[], __bss_end[];
 extern char __free_ram[], __free_ram_end[];
-extern char _binary_shell_bin_start[], _binary_shell_bin_size[];
+extern char _binary_shell_exe_start[], _binary_shell_exe_size[];
 
 extern struct process procs[PROCS_MAX];
-extern struct process *current_proc;
-extern struct process *idle_proc;
+
+uint32_t boot_hartid; // hart we booted on, handed over by the SBI in a0
+
+void wait_for_interrupt(void);
 
 // ┌────────────────────────────────────────────────────────────────────────────
 // │
@@ -40,11 +43,89 @@ void virtio_reg_fetch_and_or32(unsigned offset, uint32_t value) {
   virtio_reg_write32(offset, virtio_reg_read32(offset) | value);
 }
 
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        PLIC │
+//                                      ────────────────────────────────────────┘
+
+// route the device interrupts we handle to this hart's S-mode context
+void plic_init(void) {
+  *(volatile uint32_t *)PLIC_PRIORITY(VIRTIO_BLK_IRQ) = 1;
+  *(volatile uint32_t *)PLIC_PRIORITY(UART_IRQ) = 1;
+  *(volatile uint32_t *)PLIC_SENABLE(boot_hartid) =
+      (1 << VIRTIO_BLK_IRQ) | (1 << UART_IRQ);
+  *(volatile uint32_t *)PLIC_STHRESHOLD(boot_hartid) = 0;
+  WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
+}
+
+// highest priority pending interrupt, 0 if there is none
+uint32_t plic_claim(void) {
+  return *(volatile uint32_t *)PLIC_SCLAIM(boot_hartid);
+}
+
+// tell the PLIC we are done with `irq`
+void plic_complete(uint32_t irq) {
+  *(volatile uint32_t *)PLIC_SCLAIM(boot_hartid) = irq;
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        uart input │
+//                                      ────────────────────────────────────────┘
+
+// received characters, filled by the interrupt handler and emptied by
+// uart_read. positions only grow, like the kernel log.
+char uart_rx_buf[UART_RX_SIZE];
+uint32_t uart_rx_head; // next position the interrupt handler fills
+uint32_t uart_rx_tail; // next position a reader takes
+
+uint8_t uart_reg_read(unsigned reg) {
+  return *((volatile uint8_t *)(UART_PADDR + reg));
+}
+
+void uart_reg_write(unsigned reg, uint8_t value) {
+  *((volatile uint8_t *)(UART_PADDR + reg)) = value;
+}
+
+// have the uart raise an interrupt for every character received. output
+// still goes through the SBI console.
+void uart_init(void) { uart_reg_write(UART_IER, UART_IER_RX); }
+
+// moves everything the uart holds into the ring and wakes up readers.
+// characters that do not fit are dropped.
+void uart_interrupt(void) {
+  while (uart_reg_read(UART_LSR) & UART_LSR_DR) {
+    char ch = uart_reg_read(UART_RBR);
+    if (uart_rx_head - uart_rx_tail < UART_RX_SIZE)
+      uart_rx_buf[uart_rx_head++ % UART_RX_SIZE] = ch;
+  }
+  wakeup(&uart_rx_head);
+}
+
+// sleeps until there is input, then takes up to `len` characters of it.
+// returns how many were taken, always at least one.
+size_t uart_read(char *dst, size_t len) {
+  while (uart_rx_head == uart_rx_tail)
+    sleep_on(&uart_rx_head);
+
+  size_t n = 0;
+  while (n < len && uart_rx_tail != uart_rx_head)
+    dst[n++] = uart_rx_buf[uart_rx_tail++ % UART_RX_SIZE];
+  return n;
+}
+
 // virtio structures
 struct virtio_virtq *blk_request_vq;
-struct virtio_blk_req *blk_req;
-paddr_t blk_req_paddr;
+struct virtio_blk_req *blk_reqs; // one request header per head descriptor
+paddr_t blk_reqs_paddr;
+struct blk_request *blk_inflight[VIRTQ_ENTRY_NUM]; // by head descriptor
 uint64_t blk_capacity;
+uint32_t blk_seg_size;    // max bytes per data descriptor (size_max)
+uint32_t blk_max_segs;    // max data descriptors per request (seg_max)
 
 // virtqueu init
 struct virtio_virtq *virtq_init(unsigned index) {
@@ -54,6 +135,11 @@ struct virtio_virtq *virtq_init(unsigned index) {
   struct virtio_virtq *vq = (struct virtio_virtq *)virtq_paddr;
   vq->queue_index = index;
   vq->used_index = (volatile uint16_t *)&vq->used.index;
+  // chain every descriptor into the free list
+  for (int i = 0; i < VIRTQ_ENTRY_NUM; i++)
+    vq->descs[i].next = i + 1;
+  vq->free_head = 0;
+  vq->num_free = VIRTQ_ENTRY_NUM;
   // 1. Select the queue writing its index (first queue is 0) to QueueSel.
   virtio_reg_write32(VIRTIO_REG_QUEUE_SEL, index);
   // 5. Notify the device about the queue size by writing the size to QueueNum.
@@ -82,6 +168,12 @@ void virtio_blk_init(void) {
   virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK);
   // 3. Set the DRIVER status bit.
   virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER);
+  // 4. Negotiate features: we only care about the request size limits.
+  virtio_reg_write32(VIRTIO_REG_HOST_FEATURES_SEL, 0);
+  uint32_t features = virtio_reg_read32(VIRTIO_REG_HOST_FEATURES) &
+                      (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX);
+  virtio_reg_write32(VIRTIO_REG_GUEST_FEATURES_SEL, 0);
+  virtio_reg_write32(VIRTIO_REG_GUEST_FEATURES, features);
   // 5. Set the FEATURES_OK status bit.
   virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FEAT_OK);
   // 7. Perform device-specific setup, including discovery of virtqueues for the
@@ -94,85 +186,647 @@ void virtio_blk_init(void) {
   blk_capacity = virtio_reg_read64(VIRTIO_REG_DEVICE_CONFIG + 0) * SECTOR_SIZE;
   printf("virtio-blk: capacity is %d bytes\n", blk_capacity);
 
-  // Allocate a region to store requests to the device.
-  blk_req_paddr =
-      alloc_pages(align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-  blk_req = (struct virtio_blk_req *)blk_req_paddr;
+  // A request is header + data segments + status and has to fit in the
+  // queue. Without SIZE_MAX/SEG_MAX the device accepts anything.
+  blk_seg_size = 1u << 31;
+  if (features & VIRTIO_BLK_F_SIZE_MAX)
+    blk_seg_size = virtio_reg_read32(VIRTIO_REG_DEVICE_CONFIG + 8);
+  blk_seg_size &= ~(SECTOR_SIZE - 1);
+  blk_max_segs = VIRTQ_ENTRY_NUM - 2;
+  if (features & VIRTIO_BLK_F_SEG_MAX) {
+    uint32_t seg_max = virtio_reg_read32(VIRTIO_REG_DEVICE_CONFIG + 12);
+    if (seg_max > 0 && seg_max < blk_max_segs)
+      blk_max_segs = seg_max;
+  }
+  if (blk_seg_size == 0)
+    PANIC("virtio: size_max is smaller than a sector");
+
+  // Allocate a region to store requests to the device, one per descriptor so
+  // that any head descriptor can index its own request.
+  blk_reqs_paddr = alloc_pages(
+      align_up(sizeof(*blk_reqs) * VIRTQ_ENTRY_NUM, PAGE_SIZE) / PAGE_SIZE);
+  blk_reqs = (struct virtio_blk_req *)blk_reqs_paddr;
+}
+
+// Takes a descriptor off the free list. Returns -1 if the queue is full.
+int virtq_alloc_desc(struct virtio_virtq *vq) {
+  if (vq->num_free == 0)
+    return -1;
+
+  int index = vq->free_head;
+  vq->free_head = vq->descs[index].next;
+  vq->num_free--;
+  return index;
+}
+
+// Puts a whole descriptor chain starting at `head` back on the free list.
+void virtq_free_chain(struct virtio_virtq *vq, int head) {
+  int index = head;
+  while (vq->descs[index].flags & VIRTQ_DESC_F_NEXT) {
+    vq->num_free++;
+    index = vq->descs[index].next;
+  }
+  vq->num_free++;
+  vq->descs[index].next = vq->free_head;
+  vq->free_head = head;
 }
 
-// Notifies the device that there is a new request. `desc_index` is the index
-// of the head descriptor of the new request.
-void virtq_kick(struct virtio_virtq *vq, int desc_index) {
+// Makes the chain starting at `desc_index` available to the device. The
+// device is not told until virtq_notify, so several requests can be queued
+// with a single doorbell.
+void virtq_push(struct virtio_virtq *vq, int desc_index) {
   vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
+  __sync_synchronize();
   vq->avail.index++;
+}
+
+// Notifies the device that there are new requests.
+void virtq_notify(struct virtio_virtq *vq) {
   __sync_synchronize();
   virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
-  vq->last_used_index++;
 }
 
 // Returns whether there are requests being processed by the device.
 bool virtq_is_busy(struct virtio_virtq *vq) {
-  return vq->last_used_index != *vq->used_index;
+  return vq->num_free != VIRTQ_ENTRY_NUM;
+}
+
+// Where sector `i` of `req` goes in memory. Kernel memory is identity
+// mapped, so this is also the physical address.
+paddr_t blk_sector_addr(struct blk_request *req, uint32_t i) {
+  if (req->segs)
+    return (paddr_t)req->segs[i];
+  return (paddr_t)req->buf + i * SECTOR_SIZE;
+}
+
+// Data descriptors for sectors [i, count) of `req` start at sector i and
+// cover the physically contiguous stretch after it, up to blk_seg_size.
+// Returns the number of sectors the descriptor starting at `i` covers.
+uint32_t blk_seg_sectors(struct blk_request *req, uint32_t i) {
+  uint32_t n = 1;
+  while (i + n < req->count && (n + 1) * SECTOR_SIZE <= blk_seg_size &&
+         blk_sector_addr(req, i + n) ==
+             blk_sector_addr(req, i) + n * SECTOR_SIZE)
+    n++;
+  return n;
+}
+
+// Builds the descriptor chain for `req` and queues it: one header, one data
+// descriptor per physically contiguous stretch of the caller's buffer (at
+// most blk_seg_size bytes), one status byte. Returns false if there are not
+// enough free descriptors; the caller should reap completions with blk_poll
+// and try again.
+bool blk_submit(struct blk_request *req) {
+  req->done = false;
+  if (req->count == 0 ||
+      req->sector + req->count > blk_capacity / SECTOR_SIZE) {
+    printf("virtio: tried to read/write sector=%d (%d sectors), but capacity "
+           "is %d\n",
+           req->sector, req->count, blk_capacity / SECTOR_SIZE);
+    req->status = VIRTIO_BLK_S_IOERR;
+    req->done = true;
+    return true;
+  }
+
+  uint32_t nsegs = 0;
+  for (uint32_t i = 0; i < req->count; i += blk_seg_sectors(req, i))
+    nsegs++;
+  if (nsegs > blk_max_segs)
+    PANIC("virtio: request of %d sectors needs %d segments, more than %d",
+          req->count, nsegs, blk_max_segs);
+
+  struct virtio_virtq *vq = blk_request_vq;
+  if (vq->num_free < nsegs + 2)
+    return false;
+
+  // Construct the request according to the virtio-blk specification.
+  int head = virtq_alloc_desc(vq);
+  struct virtio_blk_req *blk_req = &blk_reqs[head];
+  paddr_t blk_req_paddr = blk_reqs_paddr + head * sizeof(*blk_req);
+  blk_req->sector = req->sector;
+  blk_req->type = req->is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  blk_req->status = 0xff;
+
+  vq->descs[head].addr = blk_req_paddr;
+  vq->descs[head].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
+  vq->descs[head].flags = VIRTQ_DESC_F_NEXT;
+
+  // data segments, written by the device on reads
+  int prev = head;
+  for (uint32_t i = 0; i < req->count;) {
+    uint32_t n = blk_seg_sectors(req, i);
+    int d = virtq_alloc_desc(vq);
+    vq->descs[prev].next = d;
+    vq->descs[d].addr = blk_sector_addr(req, i);
+    vq->descs[d].len = n * SECTOR_SIZE;
+    vq->descs[d].flags =
+        VIRTQ_DESC_F_NEXT | (req->is_write ? 0 : VIRTQ_DESC_F_WRITE);
+    prev = d;
+    i += n;
+  }
+
+  int d = virtq_alloc_desc(vq);
+  vq->descs[prev].next = d;
+  vq->descs[d].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
+  vq->descs[d].len = sizeof(uint8_t);
+  vq->descs[d].flags = VIRTQ_DESC_F_WRITE;
+
+  blk_inflight[head] = req;
+  virtq_push(vq, head);
+  return true;
+}
+
+// Reaps every completion the device has posted to the used ring. The used
+// element's id is the head descriptor of the finished chain.
+void blk_poll(void) {
+  struct virtio_virtq *vq = blk_request_vq;
+  while (vq->last_used_index != *vq->used_index) {
+    __sync_synchronize();
+    int head = vq->used.ring[vq->last_used_index % VIRTQ_ENTRY_NUM].id;
+    vq->last_used_index++;
+
+    struct virtio_blk_req *blk_req = &blk_reqs[head];
+    struct blk_request *req = blk_inflight[head];
+    blk_inflight[head] = NULL;
+
+    // virtio-blk: If a non-zero value is returned, it's an error.
+    req->status = blk_req->status;
+    if (req->status != 0)
+      printf("virtio: warn: failed to read/write sector=%d status=%d\n",
+             req->sector, req->status);
+
+    virtq_free_chain(vq, head);
+    req->done = true;
+    wakeup(req);
+    wakeup(vq); // descriptors were freed
+  }
+}
+
+// Interrupt handler: acknowledge the device and reap completions.
+void virtio_blk_interrupt(void) {
+  virtio_reg_write32(VIRTIO_REG_INTERRUPT_ACK,
+                     virtio_reg_read32(VIRTIO_REG_INTERRUPT_STATUS) & 0x3);
+  blk_poll();
+}
+
+// Waits for the device to make progress. A process sleeps on `chan` and lets
+// others run until the interrupt handler wakes it up; during boot and in the
+// idle process there is nobody to switch to, so we wait for the interrupt
+// right here.
+void blk_sleep(void *chan) {
+  if (!current_proc || current_proc == idle_proc)
+    wait_for_interrupt();
+  else
+    sleep_on(chan);
+}
+
+// Blocks until `req` has completed.
+void blk_wait(struct blk_request *req) {
+  while (!req->done)
+    blk_sleep(req);
 }
 
 // ┌────────────────────────────────────────────────────────────────────────────
 // │
 // │
 //
-//        "tar" filesystem stuff │
+//        buffer cache │
 //                                      ────────────────────────────────────────┘
 
-// Reads/writes from/to virtio-blk device.
-void read_write_disk(void *buf, unsigned sector, int is_write) {
-  if (sector >= blk_capacity / SECTOR_SIZE) {
-    printf("virtio: tried to read/write sector=%d, but capacity is %d\n",
-           sector, blk_capacity / SECTOR_SIZE);
+// sector buffers, handed out on demand up to BCACHE_MAX. the data of the
+// BUFS_PER_PAGE buffers of page slot p, bufs[p * BUFS_PER_PAGE...], shares
+// bcache_pages[p], so whole pages can be given back under memory pressure.
+// every buffer of a present page is on the LRU list (most recent at the
+// head) and, once it has a sector, on one hash chain. unused ones have no
+// flags and sit at the cold end.
+struct buf bufs[BCACHE_MAX];
+uint8_t *bcache_pages[BCACHE_MAX / BUFS_PER_PAGE]; // NULL: slot not in use
+unsigned bcache_nbufs; // buffers with a data page
+struct buf *bcache_hash[BCACHE_HASH_SIZE];
+struct buf *lru_head, *lru_tail;
+struct bcache_stats bcache_counters;
+
+void lru_unlink(struct buf *b) {
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    lru_tail = b->lru_prev;
+}
+
+void lru_push_head(struct buf *b) {
+  b->lru_prev = NULL;
+  b->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = b;
+  else
+    lru_tail = b;
+  lru_head = b;
+}
+
+void lru_push_tail(struct buf *b) {
+  b->lru_prev = lru_tail;
+  b->lru_next = NULL;
+  if (lru_tail)
+    lru_tail->lru_next = b;
+  else
+    lru_head = b;
+  lru_tail = b;
+}
+
+struct buf **hash_bucket(unsigned sector) {
+  return &bcache_hash[sector % BCACHE_HASH_SIZE];
+}
+
+// takes `b` off its hash chain, if it is on one
+void hash_remove(struct buf *b) {
+  if (!(b->flags & BUF_HASHED))
     return;
+
+  struct buf **link = hash_bucket(b->sector);
+  while (*link != b)
+    link = &(*link)->hash_next;
+  *link = b->hash_next;
+  b->flags &= ~BUF_HASHED;
+}
+
+// the buffer holding `sector`, or NULL
+struct buf *hash_lookup(unsigned sector) {
+  for (struct buf *b = *hash_bucket(sector); b; b = b->hash_next) {
+    if (b->sector == sector)
+      return b;
   }
+  return NULL;
+}
 
-  // Construct the request according to the virtio-blk specification.
-  blk_req->sector = sector;
-  blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-  if (is_write)
-    memcpy(blk_req->data, buf, SECTOR_SIZE);
+// waits until nobody is doing I/O on `b`
+void buf_wait(struct buf *b) {
+  while (b->flags & BUF_BUSY)
+    blk_sleep(b);
+}
 
-  // Construct the virtqueue descriptors (using 3 descriptors).
-  struct virtio_virtq *vq = blk_request_vq;
-  vq->descs[0].addr = blk_req_paddr;
-  vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-  vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-  vq->descs[0].next = 1;
+// drops the reference taken by bget/bread
+void brelse(struct buf *b) {
+  if (b->refcnt <= 0)
+    PANIC("brelse: buffer for sector %d is not referenced", b->sector);
+  b->refcnt--;
+}
+
+// queues the read or write of one buffer; the caller rings the doorbell
+void buf_submit(struct buf *b, bool is_write) {
+  b->flags |= BUF_BUSY;
+  b->req.buf = b->data;
+  b->req.segs = NULL;
+  b->req.sector = b->sector;
+  b->req.count = 1;
+  b->req.is_write = is_write;
+  while (!blk_submit(&b->req)) {
+    virtq_notify(blk_request_vq);
+    blk_sleep(blk_request_vq);
+  }
+}
+
+// I/O on `b` is over: mark the data valid if it worked and let other
+// waiters in. a write that failed leaves the buffer dirty.
+void buf_complete(struct buf *b, struct blk_request *req) {
+  b->flags &= ~BUF_BUSY;
+  if (req->status == 0)
+    b->flags |= BUF_VALID;
+  else if (req->is_write)
+    b->flags |= BUF_DIRTY;
+  wakeup(b);
+}
 
-  vq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-  vq->descs[1].len = SECTOR_SIZE;
-  vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-  vq->descs[1].next = 2;
+// waits for the I/O queued by buf_submit and lets other waiters in
+void buf_finish(struct buf *b) {
+  blk_wait(&b->req);
+  buf_complete(b, &b->req);
+}
 
-  vq->descs[2].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
-  vq->descs[2].len = sizeof(uint8_t);
-  vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
+// reads or writes `n` referenced BUF_BUSY buffers, sorted by sector. runs of
+// consecutive sectors go out as one request each and as many requests as the
+// virtqueue has room for are kept in flight. every buffer is completed by
+// the time we return.
+void bcache_io(struct buf **list, unsigned n, bool is_write) {
+  struct blk_request reqs[BLK_MAX_INFLIGHT];
+  unsigned first[BLK_MAX_INFLIGHT]; // list index of each request's first buf
+  uint8_t *segs[BCACHE_MAX];
+  for (unsigned i = 0; i < n; i++)
+    segs[i] = list[i]->data;
+
+  unsigned next = 0; // first buffer not submitted yet
+  unsigned submitted = 0, retired = 0;
+  while (next < n || retired < submitted) {
+    // fill the queue, one doorbell for the whole batch
+    bool queued = false;
+    while (next < n && submitted - retired < BLK_MAX_INFLIGHT) {
+      unsigned run = 1;
+      while (next + run < n && run < blk_max_segs &&
+             list[next + run]->sector == list[next]->sector + run)
+        run++;
+
+      struct blk_request *req = &reqs[submitted % BLK_MAX_INFLIGHT];
+      req->buf = NULL;
+      req->segs = &segs[next];
+      req->sector = list[next]->sector;
+      req->count = run;
+      req->is_write = is_write;
+      if (!blk_submit(req))
+        break;
+      first[submitted % BLK_MAX_INFLIGHT] = next;
+      next += run;
+      submitted++;
+      queued = true;
+    }
+    if (queued)
+      virtq_notify(blk_request_vq);
+
+    if (retired < submitted)
+      blk_wait(&reqs[retired % BLK_MAX_INFLIGHT]);
+    else
+      blk_sleep(blk_request_vq); // queue is full of someone else's requests
+
+    while (retired < submitted && reqs[retired % BLK_MAX_INFLIGHT].done) {
+      struct blk_request *req = &reqs[retired % BLK_MAX_INFLIGHT];
+      for (unsigned i = 0; i < req->count; i++)
+        buf_complete(list[first[retired % BLK_MAX_INFLIGHT] + i], req);
+      retired++;
+    }
+  }
+}
 
-  // Notify the device that there is a new request.
-  virtq_kick(vq, 0);
+// sorts buffers by sector so bcache_io can merge neighbours
+void bufs_sort(struct buf **list, unsigned n) {
+  for (unsigned i = 1; i < n; i++) {
+    struct buf *b = list[i];
+    unsigned j = i;
+    for (; j > 0 && list[j - 1]->sector > b->sector; j--)
+      list[j] = list[j - 1];
+    list[j] = b;
+  }
+}
 
-  // Wait until the device finishes processing.
-  while (virtq_is_busy(vq))
-    ;
+// takes a dirty buffer for write-back. the dirty bit is cleared before the
+// write: if someone dirties the buffer again while it is in flight, it
+// simply goes out again next time.
+void buf_claim_dirty(struct buf *b) {
+  b->flags = (b->flags & ~BUF_DIRTY) | BUF_BUSY;
+  bcache_counters.writebacks++;
+}
 
-  // virtio-blk: If a non-zero value is returned, it's an error.
-  if (blk_req->status != 0) {
-    printf("virtio: warn: failed to read/write sector=%d status=%d\n", sector,
-           blk_req->status);
-    return;
+// writes back every buffer that is dirty when we are called. the dirty set
+// is picked up in one go, with a reference on each buffer, before anything
+// sleeps. buffers another write-back has in flight may have been dirtied
+// again since it started, so we wait for those and write them if needed.
+void bcache_sync(void) {
+  struct buf *list[BCACHE_MAX];
+  struct buf *busy[BCACHE_MAX];
+  unsigned n = 0, nbusy = 0;
+  for (struct buf *b = lru_head; b; b = b->lru_next) {
+    if (!(b->flags & BUF_DIRTY))
+      continue;
+    b->refcnt++;
+    if (b->flags & BUF_BUSY) {
+      busy[nbusy++] = b;
+    } else {
+      buf_claim_dirty(b);
+      list[n++] = b;
+    }
   }
 
-  // For read operations, copy the data into the buffer.
-  if (!is_write)
-    memcpy(buf, blk_req->data, SECTOR_SIZE);
+  bufs_sort(list, n);
+  bcache_io(list, n, true);
+  for (unsigned i = 0; i < n; i++)
+    brelse(list[i]);
+
+  for (unsigned i = 0; i < nbusy; i++) {
+    struct buf *b = busy[i];
+    buf_wait(b);
+    if (b->flags & BUF_DIRTY) {
+      buf_claim_dirty(b);
+      bcache_io(&b, 1, true);
+    }
+    brelse(b);
+  }
+}
+
+// background write-back: a kernel thread woken every BCACHE_FLUSH_TICKS
+// timer ticks that writes back whatever is dirty, so sync has less to do
+// and a crash loses less
+uint32_t bcache_flush_ticks;
+
+void bcache_flusher(void *arg) {
+  (void)arg;
+  for (;;) {
+    sleep_on(&bcache_flush_ticks);
+    bcache_sync();
+  }
+}
+
+// a buffer nobody uses and that can be thrown away without I/O
+struct buf *bcache_victim(void) {
+  for (struct buf *b = lru_tail; b; b = b->lru_prev) {
+    if (b->refcnt == 0 && !(b->flags & (BUF_BUSY | BUF_DIRTY)))
+      return b;
+  }
+  return NULL;
 }
 
-struct file files[FILES_MAX];
-uint8_t disk[DISK_MAX_SIZE];
+// adds one page worth of unused buffers at the cold end of the LRU list.
+// alloc_pages may run bcache_shrink, which never touches an empty slot.
+void bcache_grow(void) {
+  uint8_t *page = (uint8_t *)alloc_pages(1);
+  unsigned p = 0;
+  while (bcache_pages[p])
+    p++;
+
+  bcache_pages[p] = page;
+  for (unsigned i = 0; i < BUFS_PER_PAGE; i++) {
+    struct buf *b = &bufs[p * BUFS_PER_PAGE + i];
+    b->data = page + i * SECTOR_SIZE;
+    b->flags = 0;
+    b->refcnt = 0;
+    lru_push_tail(b);
+  }
+  bcache_nbufs += BUFS_PER_PAGE;
+}
+
+// a buffer for a sector that is not cached yet: grow the cache while we may,
+// then recycle the least recently used clean buffer. if only dirty ones are
+// left, that is our cue to write everything back. the buffer comes back
+// unhashed. this may sleep, so the caller has to look the sector up again.
+struct buf *bcache_alloc(void) {
+  bool have_unused =
+      lru_tail && lru_tail->flags == 0 && lru_tail->refcnt == 0;
+  if (!have_unused && bcache_nbufs < BCACHE_MAX)
+    bcache_grow();
+
+  struct buf *b = bcache_victim();
+  if (!b) {
+    bcache_sync();
+    b = bcache_victim();
+  }
+  if (!b)
+    PANIC("bcache: every buffer is in use");
+
+  if (b->flags & BUF_HASHED)
+    bcache_counters.evictions++;
+  hash_remove(b);
+  b->flags = 0;
+  return b;
+}
+
+// finds or allocates the buffer for `sector` and takes a reference to it.
+// the contents are only valid if BUF_VALID is set.
+struct buf *bget(unsigned sector) {
+  struct buf *b = hash_lookup(sector);
+  if (b) {
+    bcache_counters.hits++;
+    b->refcnt++;
+    lru_unlink(b);
+    lru_push_head(b);
+    return b;
+  }
+
+  bcache_counters.misses++;
+  b = bcache_alloc();
+
+  // someone else may have cached the sector while bcache_alloc slept. our
+  // buffer then goes to the cold end of the LRU list, to be recycled first.
+  struct buf *cached = hash_lookup(sector);
+  if (cached) {
+    lru_unlink(b);
+    lru_push_tail(b);
+
+    cached->refcnt++;
+    lru_unlink(cached);
+    lru_push_head(cached);
+    return cached;
+  }
+
+  b->sector = sector;
+  b->flags = BUF_HASHED;
+  b->refcnt = 1;
+  b->hash_next = *hash_bucket(sector);
+  *hash_bucket(sector) = b;
+  lru_unlink(b);
+  lru_push_head(b);
+  return b;
+}
+
+// returns a referenced buffer holding `sector`, reading it if needed
+struct buf *bread(unsigned sector) {
+  struct buf *b = bget(sector);
+  buf_wait(b);
+  if (!(b->flags & BUF_VALID)) {
+    buf_submit(b, false);
+    virtq_notify(blk_request_vq);
+    buf_finish(b);
+  }
+  return b;
+}
+
+// marks a buffer as modified, it goes to disk on the next write-back
+void bdirty(struct buf *b) { b->flags |= BUF_VALID | BUF_DIRTY; }
+
+// copies one sector out of the cache
+void bcache_read(unsigned sector, void *dst) {
+  struct buf *b = bread(sector);
+  memcpy(dst, b->data, SECTOR_SIZE);
+  brelse(b);
+}
+
+// overwrites one whole sector in the cache, no need to read it first
+void bcache_write(unsigned sector, const void *src) {
+  struct buf *b = bget(sector);
+  buf_wait(b);
+  memcpy(b->data, src, SECTOR_SIZE);
+  bdirty(b);
+  brelse(b);
+}
+
+// pulls `count` sectors into the cache, reading runs of missing sectors
+// with one request each and several requests in flight
+void bcache_readahead(unsigned sector, unsigned count) {
+  struct buf *pending[BCACHE_MAX / 2];
+  unsigned n = 0;
+  for (unsigned i = 0; i < count && n < BCACHE_MAX / 2; i++) {
+    struct buf *b = bget(sector + i);
+    if (b->flags & (BUF_VALID | BUF_BUSY)) {
+      brelse(b);
+      continue;
+    }
+    // busy from here on, so nobody else starts a read of it meanwhile
+    b->flags |= BUF_BUSY;
+    pending[n++] = b;
+  }
+
+  bcache_io(pending, n, false);
+  for (unsigned i = 0; i < n; i++)
+    brelse(pending[i]);
+}
+
+// memory pressure, called from inside alloc_pages: gives back every buffer
+// page whose buffers are all unreferenced, idle and clean, and skips the
+// rest. no I/O and no sleeping here, dirty buffers only become reclaimable
+// once bcache_sync or the flusher has written them. best effort: a cache
+// full of dirty or pinned buffers frees nothing.
+void bcache_shrink(void) {
+  for (unsigned p = 0; p < BCACHE_MAX / BUFS_PER_PAGE; p++) {
+    if (!bcache_pages[p])
+      continue;
+
+    struct buf *page_bufs = &bufs[p * BUFS_PER_PAGE];
+    bool idle = true;
+    for (unsigned i = 0; i < BUFS_PER_PAGE && idle; i++) {
+      struct buf *b = &page_bufs[i];
+      idle = b->refcnt == 0 && !(b->flags & (BUF_BUSY | BUF_DIRTY));
+    }
+    if (!idle)
+      continue;
+
+    for (unsigned i = 0; i < BUFS_PER_PAGE; i++) {
+      struct buf *b = &page_bufs[i];
+      hash_remove(b);
+      lru_unlink(b);
+      b->flags = 0;
+      b->data = NULL;
+    }
+    free_pages((paddr_t)bcache_pages[p], 1);
+    bcache_pages[p] = NULL;
+    bcache_nbufs -= BUFS_PER_PAGE;
+  }
+}
+
+// copies the cache counters
+void bcache_get_stats(struct bcache_stats *stats) {
+  *stats = bcache_counters;
+  stats->buffers = bcache_nbufs;
+  stats->dirty = 0;
+  for (struct buf *b = lru_head; b; b = b->lru_next) {
+    if (b->flags & BUF_DIRTY)
+      stats->dirty++;
+  }
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        "tar" filesystem stuff │
+//                                      ────────────────────────────────────────┘
+
+// the file table lives in pages from the page allocator and grows with the
+// archive. names are found through a hash of file indices (indices rather
+// than pointers, so the table can move when it grows).
+struct file *files;
+unsigned files_count;    // entries used at the front of files[]
+unsigned files_cap;      // entries files[] has room for
+int *file_hash;          // chain heads, -1 ends a chain
+unsigned file_hash_size; // a power of two, at least files_cap
 
 int oct2int(char *oct, int len) {
   int dec = 0;
@@ -185,76 +839,437 @@ int oct2int(char *oct, int len) {
   return dec;
 }
 
-void fs_init(void) {
-  for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-    read_write_disk(&disk[sector * SECTOR_SIZE], sector, false);
+// a file that grew past the sectors reserved for it, or anything else that
+// moves files around on disk, forces the next flush to lay the archive out
+// again from scratch
+bool fs_layout_dirty;
+
+// data sectors needed for `size` bytes of file content
+unsigned fs_data_sectors(size_t size) {
+  return align_up(size, SECTOR_SIZE) / SECTOR_SIZE;
+}
+
+// FNV-1a over a file name
+uint32_t fs_name_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name)
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+  return h;
+}
+
+// bytes rounded up to whole pages
+uint32_t fs_table_pages(size_t bytes) {
+  return align_up(bytes, PAGE_SIZE) / PAGE_SIZE;
+}
+
+// puts files[index] on its hash chain, once its name is set
+void fs_hash_insert(unsigned index) {
+  uint32_t bucket = fs_name_hash(files[index].name) & (file_hash_size - 1);
+  files[index].hash_next = file_hash[bucket];
+  file_hash[bucket] = index;
+}
+
+// rebuilds the hash chains after the table moved or grew
+void fs_rehash(void) {
+  unsigned size = 1;
+  while (size < files_cap)
+    size *= 2;
+
+  if (size != file_hash_size) {
+    if (file_hash)
+      free_pages((paddr_t)file_hash,
+                 fs_table_pages(file_hash_size * sizeof(*file_hash)));
+    file_hash = (int *)alloc_pages(fs_table_pages(size * sizeof(*file_hash)));
+    file_hash_size = size;
+  }
+
+  for (unsigned i = 0; i < file_hash_size; i++)
+    file_hash[i] = -1;
+  for (unsigned i = 0; i < files_count; i++)
+    fs_hash_insert(i);
+}
+
+// a fresh entry at the end of the file table, doubling the table when full.
+// pointers into the old table are stale afterwards.
+struct file *fs_alloc_file(void) {
+  if (files_count == files_cap) {
+    size_t old_bytes = files_cap * sizeof(struct file);
+    uint32_t pages = fs_table_pages(old_bytes ? old_bytes * 2 : 1);
+    struct file *table = (struct file *)alloc_pages(pages);
+    if (files) {
+      memcpy(table, files, files_count * sizeof(struct file));
+      free_pages((paddr_t)files, fs_table_pages(old_bytes));
+    }
+    files = table;
+    files_cap = pages * PAGE_SIZE / sizeof(struct file);
+    fs_rehash();
+  }
+
+  struct file *file = &files[files_count++];
+  memset(file, 0, sizeof(*file));
+  file->hash_next = -1;
+  return file;
+}
+
+// fs_lookup: the file called `name`, or NULL
+struct file *fs_lookup(const char *name) {
+  if (!file_hash)
+    return NULL;
+
+  uint32_t bucket = fs_name_hash(name) & (file_hash_size - 1);
+  for (int i = file_hash[bucket]; i >= 0; i = files[i].hash_next) {
+    if (files[i].in_use && strcmp(files[i].name, name) == 0)
+      return &files[i];
+  }
+  return NULL;
+}
+
+// extent structs are carved out of whole pages and recycled on a free list
+struct extent *extent_free_list;
 
-  unsigned off = 0;
-  for (int i = 0; i < FILES_MAX; i++) {
-    struct tar_header *header = (struct tar_header *)&disk[off];
-    if (header->name[0] == '\0')
+struct extent *extent_alloc(void) {
+  if (!extent_free_list) {
+    struct extent *page = (struct extent *)alloc_pages(1);
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(*page); i++) {
+      page[i].next = extent_free_list;
+      extent_free_list = &page[i];
+    }
+  }
+
+  struct extent *e = extent_free_list;
+  extent_free_list = e->next;
+  memset(e, 0, sizeof(*e));
+  return e;
+}
+
+// drops a file's extents, with the pages of the in-memory ones
+void extent_free_all(struct file *file) {
+  while (file->extents) {
+    struct extent *e = file->extents;
+    file->extents = e->next;
+    if (e->page)
+      free_pages(e->page, e->bytes / PAGE_SIZE);
+    e->next = extent_free_list;
+    extent_free_list = e;
+  }
+}
+
+// an extent covering `count` sectors on disk starting at `sector`
+struct extent *extent_disk(unsigned sector, unsigned count) {
+  struct extent *e = extent_alloc();
+  e->sector = sector;
+  e->bytes = count * SECTOR_SIZE;
+  return e;
+}
+
+// fs_init: build the file index from the tar headers alone. the data
+// sectors are only described by an extent and read through the buffer
+// cache when someone touches them.
+void fs_init(void) {
+  unsigned disk_sectors = blk_capacity / SECTOR_SIZE;
+  unsigned sector = 0;
+  while (sector < disk_sectors) {
+    struct buf *b = bread(sector);
+    struct tar_header *header = (struct tar_header *)b->data;
+    if (header->name[0] == '\0') {
+      brelse(b);
       break;
+    }
 
     if (strcmp(header->magic, "ustar") != 0)
       PANIC("invalid tar header: magic=\"%s\"", header->magic);
 
     int filesz = oct2int(header->size, sizeof(header->size));
-    struct file *file = &files[i];
+    struct file *file = fs_alloc_file();
     file->in_use = true;
     strcpy(file->name, header->name);
-    memcpy(file->data, header->data, filesz);
+    brelse(b);
+    fs_hash_insert(file - files);
     file->size = filesz;
+    file->sector = sector;
+    unsigned nsectors = fs_data_sectors(filesz);
+    if (nsectors > 0)
+      file->extents = extent_disk(sector + 1, nsectors);
     printf("file: %s, size=%d\n", file->name, file->size);
 
-    off += align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE);
+    sector += 1 + nsectors;
   }
 } // fs_init
 
-// fs_flush: write all files to disk using read_write_disk
-void fs_flush(void) {
-  // copy all file contents into `disk` buffer.
-  memset(disk, 0, sizeof(disk));
-  unsigned off = 0;
-  for (int file_i = 0; file_i < FILES_MAX; file_i++) {
-    struct file *file = &files[file_i];
-    if (!file->in_use)
-      continue;
-
-    struct tar_header *header = (struct tar_header *)&disk[off];
-    memset(header, 0, sizeof(*header));
-    strcpy(header->name, file->name);
-    strcpy(header->mode, "000644");
-    strcpy(header->magic, "ustar");
-    strcpy(header->version, "00");
-    header->type = '0';
-
-    // turn the file size into an octal string.
-    int filesz = file->size;
-    for (int i = sizeof(header->size); i > 0; i--) {
-      header->size[i - 1] = (filesz % 8) + '0';
-      filesz /= 8;
+// the extent holding byte `off` of the file, and the offset inside it
+struct extent *fs_locate(struct file *file, size_t off, size_t *ext_off) {
+  for (struct extent *e = file->extents; e; e = e->next) {
+    if (off < e->bytes) {
+      *ext_off = off;
+      return e;
     }
+    off -= e->bytes;
+  }
+  PANIC("fs_locate: offset past the extents of %s", file->name);
+}
 
-    // calculate the checksum.
-    int checksum = ' ' * sizeof(header->checksum);
-    for (unsigned i = 0; i < sizeof(struct tar_header); i++)
-      checksum += (unsigned char)disk[off + i];
+// makes sure the extents of a file cover `size` bytes. growth is kept in
+// memory until the next fs_flush lays the archive out again.
+void fs_reserve(struct file *file, size_t size) {
+  size_t cap = 0;
+  struct extent **link = &file->extents;
+  for (; *link; link = &(*link)->next)
+    cap += (*link)->bytes;
+
+  while (cap < size) {
+    uint32_t pages = fs_table_pages(size - cap);
+    if (pages > FS_EXTENT_PAGES)
+      pages = FS_EXTENT_PAGES;
+
+    struct extent *e = extent_alloc();
+    e->page = alloc_pages(pages);
+    e->bytes = pages * PAGE_SIZE;
+    *link = e;
+    link = &e->next;
+    cap += e->bytes;
+    fs_layout_dirty = true;
+  }
+}
+
+// copies between `buf` and a file's extents. disk extents go through the
+// buffer cache one sector at a time; writes only dirty the sectors touched.
+void fs_rw(struct file *file, size_t off, void *buf, size_t len,
+           bool is_write) {
+  uint8_t *p = buf;
+  bool read_ahead = is_write;
+  while (len > 0) {
+    size_t eoff;
+    struct extent *e = fs_locate(file, off, &eoff);
+    size_t n;
+    if (e->page) {
+      n = e->bytes - eoff < len ? e->bytes - eoff : len;
+      if (is_write)
+        memcpy((void *)(e->page + eoff), p, n);
+      else
+        memcpy(p, (void *)(e->page + eoff), n);
+    } else {
+      unsigned sector = e->sector + eoff / SECTOR_SIZE;
+      size_t soff = eoff % SECTOR_SIZE;
+      n = SECTOR_SIZE - soff < len ? SECTOR_SIZE - soff : len;
+      if (!read_ahead) {
+        // queue every sector of this extent we are about to read at once
+        read_ahead = true;
+        unsigned left = (e->bytes - eoff + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        unsigned want = fs_data_sectors(soff + len);
+        bcache_readahead(sector, want < left ? want : left);
+      }
 
-    for (int i = 5; i >= 0; i--) {
-      header->checksum[i] = (checksum % 8) + '0';
-      checksum /= 8;
+      // a whole-sector write does not need the old contents
+      struct buf *b = (is_write && n == SECTOR_SIZE) ? bget(sector)
+                                                      : bread(sector);
+      buf_wait(b);
+      if (is_write) {
+        memcpy(b->data + soff, p, n);
+        bdirty(b);
+      } else {
+        memcpy(p, b->data + soff, n);
+      }
+      brelse(b);
     }
+    off += n;
+    p += n;
+    len -= n;
+  }
+}
+
+// fs_read: copy part of a file's content, returns the bytes copied
+size_t fs_read(struct file *file, size_t off, void *dst, size_t len) {
+  if (off >= file->size)
+    return 0;
+  if (len > file->size - off)
+    len = file->size - off;
 
-    // copy file data.
-    memcpy(header->data, file->data, file->size);
-    off += align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+  fs_rw(file, off, dst, len, false);
+  return len;
+}
+
+// fs_write: change part of a file's content. the sectors touched are dirty
+// in the buffer cache until the next fs_flush.
+void fs_write(struct file *file, size_t off, const void *src, size_t len) {
+  fs_reserve(file, off + len);
+  fs_rw(file, off, (void *)src, len, true);
+  if (off + len > file->size) {
+    file->size = off + len;
+    file->header_dirty = true;
   }
 
-  // Write `disk` buffer into the virtio-blk.
-  for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-    read_write_disk(&disk[sector * SECTOR_SIZE], sector, true);
+  // keep pages handed out to mmap in step
+  if (!file->page_cache)
+    return;
+  for (size_t done = 0; done < len;) {
+    size_t pos = off + done;
+    size_t n = PAGE_SIZE - pos % PAGE_SIZE;
+    if (n > len - done)
+      n = len - done;
+    uint32_t index = pos / PAGE_SIZE;
+    if (index < FS_MAP_MAX_PAGES && file->page_cache[index])
+      memcpy((void *)(file->page_cache[index] + pos % PAGE_SIZE),
+             (const uint8_t *)src + done, n);
+    done += n;
+  }
+}
+
+// fs_get_page: page `index` of a file's content, read in on first use and
+// kept for every later mapping. bytes past the end of the file are zero.
+// *major tells whether the page had to be read just now.
+paddr_t fs_get_page(struct file *file, uint32_t index, bool *major) {
+  if (index >= FS_MAP_MAX_PAGES)
+    PANIC("fs_get_page: %s page %d is past the mmap limit", file->name, index);
+
+  // another fault on the same file may fill the slots while we sleep in
+  // here, so look again before storing and keep whichever came first
+  if (!file->page_cache) {
+    paddr_t *table = (paddr_t *)alloc_pages(1);
+    if (file->page_cache)
+      free_pages((paddr_t)table, 1);
+    else
+      file->page_cache = table;
+  }
 
-  printf("wrote %d bytes to disk\n", sizeof(disk));
+  *major = !file->page_cache[index];
+  if (*major) {
+    paddr_t page = alloc_pages(1);
+    fs_read(file, index * PAGE_SIZE, (void *)page, PAGE_SIZE);
+    if (file->page_cache[index])
+      free_pages(page, 1);
+    else
+      file->page_cache[index] = page;
+  }
+  return file->page_cache[index];
+}
+
+// copies `len` bytes into the cached `sector`, zero-filling the rest
+void fs_write_sector(unsigned sector, const void *src, size_t len) {
+  struct buf *b = bget(sector);
+  buf_wait(b);
+  memcpy(b->data, src, len);
+  memset(b->data + len, 0, SECTOR_SIZE - len);
+  bdirty(b);
+  brelse(b);
+}
+
+// serializes the tar header of `file` into its header sector
+void fs_write_header(struct file *file) {
+  uint8_t sector[SECTOR_SIZE];
+  memset(sector, 0, sizeof(sector));
+  struct tar_header *header = (struct tar_header *)sector;
+  strcpy(header->name, file->name);
+  strcpy(header->mode, "000644");
+  strcpy(header->magic, "ustar");
+  strcpy(header->version, "00");
+  header->type = '0';
+
+  // turn the file size into an octal string.
+  int filesz = file->size;
+  for (int i = sizeof(header->size); i > 0; i--) {
+    header->size[i - 1] = (filesz % 8) + '0';
+    filesz /= 8;
+  }
+
+  // calculate the checksum.
+  int checksum = ' ' * sizeof(header->checksum);
+  for (unsigned i = 0; i < sizeof(struct tar_header); i++)
+    checksum += sector[i];
+
+  for (int i = 5; i >= 0; i--) {
+    header->checksum[i] = (checksum % 8) + '0';
+    checksum /= 8;
+  }
+
+  fs_write_sector(file->sector, sector, sizeof(sector));
+}
+
+// writes data sector `s` of a file to disk sector `dst`, straight from
+// wherever its extents keep it
+void fs_move_sector(struct file *file, unsigned s, unsigned dst) {
+  size_t eoff;
+  struct extent *e = fs_locate(file, s * SECTOR_SIZE, &eoff);
+  if (e->page) {
+    size_t left = file->size - s * SECTOR_SIZE;
+    fs_write_sector(dst, (void *)(e->page + eoff),
+                    left < SECTOR_SIZE ? left : SECTOR_SIZE);
+    return;
+  }
+
+  unsigned src = e->sector + eoff / SECTOR_SIZE;
+  if (src == dst)
+    return;
+
+  struct buf *b = bread(src);
+  fs_write_sector(dst, b->data, SECTOR_SIZE);
+  brelse(b);
+}
+
+// packs every file into one contiguous tar entry again. files only grow,
+// so nothing moves towards the start of the disk: going from the last file
+// to the first and from the last sector to the first never overwrites data
+// that has not been moved yet. returns false, with nothing written, if the
+// archive no longer fits on the disk.
+bool fs_relayout(void) {
+  unsigned end = 0;
+  for (unsigned i = 0; i < files_count; i++) {
+    if (files[i].in_use)
+      end += 1 + fs_data_sectors(files[i].size);
+  }
+  if ((end + 2) * SECTOR_SIZE > blk_capacity)
+    return false;
+
+  // the end-of-archive marker: two zero sectors
+  uint8_t zero[SECTOR_SIZE];
+  memset(zero, 0, sizeof(zero));
+  fs_write_sector(end, zero, sizeof(zero));
+  fs_write_sector(end + 1, zero, sizeof(zero));
+
+  unsigned sector = end;
+  for (unsigned i = files_count; i-- > 0;) {
+    struct file *file = &files[i];
+    if (!file->in_use)
+      continue;
+
+    unsigned nsectors = fs_data_sectors(file->size);
+    sector -= 1 + nsectors;
+    for (unsigned s = nsectors; s-- > 0;)
+      fs_move_sector(file, s, sector + 1 + s);
+
+    extent_free_all(file);
+    if (nsectors > 0)
+      file->extents = extent_disk(sector + 1, nsectors);
+    file->sector = sector;
+    file->header_dirty = true;
+  }
+  fs_layout_dirty = false;
+  return true;
+}
+
+// fs_flush: write changed headers and data sectors to disk through the
+// buffer cache. files keep their place on disk unless one outgrew it.
+// returns false if the files no longer fit on the disk; then nothing is
+// written and the grown files stay in memory.
+bool fs_flush(void) {
+  if (fs_layout_dirty && !fs_relayout()) {
+    printf("fs_flush: disk is full\n");
+    return false;
+  }
+
+  for (unsigned file_i = 0; file_i < files_count; file_i++) {
+    struct file *file = &files[file_i];
+    if (file->in_use && file->header_dirty) {
+      fs_write_header(file);
+      file->header_dirty = false;
+    }
+  }
+
+  struct bcache_stats before, after;
+  bcache_get_stats(&before);
+  bcache_sync();
+  bcache_get_stats(&after);
+  printf("wrote %d sectors to disk\n", after.writebacks - before.writebacks);
+  return true;
 } // fs_flush
 
 ////////////////////////////////////////////////////////////////////
@@ -293,49 +1308,135 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
   return (struct sbiret){.error = a0, .value = a1};
 }
 
-// allocate next page and zero it out
-paddr_t alloc_pages(uint32_t n) {
-  static paddr_t next_paddr = (paddr_t)__free_ram;
-  paddr_t paddr = next_paddr;
-  next_paddr += n * PAGE_SIZE;
+// putchar using riscv's shenanigans hidden awayin sbi_call
+void sbi_putchar(char ch) { sbi_call(ch, 0, 0, 0, 0, 0, 0, 1 /* putchar */); }
+
+// program the next timer interrupt, in `time` ticks
+// uses the TIME extension and falls back to the legacy set_timer call
+void sbi_set_timer(uint64_t stime_value) {
+  struct sbiret ret = sbi_call(stime_value, stime_value >> 32, 0, 0, 0, 0, 0,
+                               SBI_EXT_TIME);
+  if (ret.error == SBI_ERR_NOT_SUPPORTED)
+    sbi_call(stime_value, stime_value >> 32, 0, 0, 0, 0, 0, 0 /* set_timer */);
+}
+
+// raise a supervisor software interrupt on another hart
+void sbi_send_ipi(uint32_t hartid) {
+  sbi_call(1, hartid, 0, 0, 0, 0, SBI_IPI_SEND, SBI_EXT_IPI);
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        kernel log │
+//                                      ────────────────────────────────────────┘
+
+// kernel printf output goes into this ring and putchar returns at once; the
+// ring is written to the console in bulk later (flush). positions only ever
+// grow, the byte for position p lives at klog_buf[p % KLOG_SIZE]. writers
+// reserve a position with an atomic add and publish it in order through
+// klog_commit, so no lock is needed. whatever is still in the ring can be
+// read back with SYS_DMESG.
+char klog_buf[KLOG_SIZE];
+uint32_t klog_head;   // positions handed out to writers
+uint32_t klog_commit; // bytes written and visible to readers
+uint32_t klog_tail;   // bytes already sent to the console
+bool klog_draining;   // someone is inside flush
+bool sbi_has_dbcn;    // the SBI debug console extension is there
+
+// look for the SBI debug console, which takes a whole buffer per call
+void console_init(void) {
+  struct sbiret ret = sbi_call(SBI_EXT_DBCN, 0, 0, 0, 0, 0, SBI_BASE_PROBE_EXT,
+                               SBI_EXT_BASE);
+  sbi_has_dbcn = ret.error == 0 && ret.value != 0;
+}
 
-  if (next_paddr > (paddr_t)__free_ram_end)
-    PANIC("out of memory");
+// writes `n` bytes straight to the console
+void console_write(const char *buf, size_t n) {
+  while (n > 0 && sbi_has_dbcn) {
+    // the kernel is identity mapped, so buf is also the physical address
+    struct sbiret ret = sbi_call(n, (uint32_t)buf, 0, 0, 0, 0, SBI_DBCN_WRITE,
+                                 SBI_EXT_DBCN);
+    if (ret.error != 0)
+      break;
+    buf += ret.value;
+    n -= ret.value;
+  }
 
-  memset((void *)paddr, 0, n * PAGE_SIZE);
-  return paddr;
+  for (size_t i = 0; i < n; i++)
+    sbi_putchar(buf[i]);
 }
 
-// map pages using riscv's Sv32's page table
-// vpn: virtual page number
-// pfn: physical frame number
-// pages are virtual, frames are physical
-// Sv32 uses two-level page table
-void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
-  if (!is_aligned(vaddr, PAGE_SIZE))
-    PANIC("unaligned vaddr %x", vaddr);
+void putchar(char ch) {
+  uint32_t pos = __atomic_fetch_add(&klog_head, 1, __ATOMIC_RELAXED);
+
+  // the ring is full of output the console has not seen yet
+  while (pos - __atomic_load_n(&klog_tail, __ATOMIC_ACQUIRE) >= KLOG_SIZE)
+    flush();
 
-  if (!is_aligned(paddr, PAGE_SIZE))
-    PANIC("unaligned paddr %x", paddr);
+  klog_buf[pos % KLOG_SIZE] = ch;
 
-  uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
-  if ((table1[vpn1] & PAGE_V) == 0) {
-    uint32_t pt_paddr = alloc_pages(1);
-    table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V;
+  // publish in order: wait for writers that got earlier positions
+  while (__atomic_load_n(&klog_commit, __ATOMIC_ACQUIRE) != pos)
+    ;
+  __atomic_store_n(&klog_commit, pos + 1, __ATOMIC_RELEASE);
+}
+
+// sends everything committed to the ring to the console, one SBI call per
+// contiguous stretch. if someone else is already at it, leave it to them.
+void flush(void) {
+  if (__atomic_exchange_n(&klog_draining, true, __ATOMIC_ACQUIRE))
+    return;
+
+  uint32_t tail = klog_tail;
+  uint32_t end = __atomic_load_n(&klog_commit, __ATOMIC_ACQUIRE);
+  while (tail != end) {
+    uint32_t off = tail % KLOG_SIZE;
+    uint32_t n = end - tail < KLOG_SIZE - off ? end - tail : KLOG_SIZE - off;
+    console_write(&klog_buf[off], n);
+    tail += n;
+    __atomic_store_n(&klog_tail, tail, __ATOMIC_RELEASE);
   }
+  __atomic_store_n(&klog_draining, false, __ATOMIC_RELEASE);
+}
 
-  uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
-  uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
-  table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        timer │
+//                                      ────────────────────────────────────────┘
+
+// 64-bit time counter, re-read if the upper half ticked over in between
+uint64_t read_time(void) {
+  uint32_t hi, lo;
+  do {
+    hi = READ_CSR(timeh);
+    lo = READ_CSR(time);
+  } while (hi != READ_CSR(timeh));
+  return ((uint64_t)hi << 32) | lo;
 }
 
-// putchar using riscv's shenanigans hidden awayin sbi_call
-void putchar(char ch) { sbi_call(ch, 0, 0, 0, 0, 0, 0, 1 /* putchar */); }
+// arm the timer for the end of the next time slice
+void timer_set_next(void) {
+  sbi_set_timer(read_time() + TIMEBASE_HZ / 1000 * TIME_SLICE_MS);
+}
 
-// same as putchar, except we are getting something out
-long getchar(void) {
-  struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, 2 /* getchar */);
-  return ret.error;
+// a time slice is over: rearm, and kick the write-back thread now and then
+// (counting the boot hart's ticks only)
+void timer_tick(void) {
+  timer_set_next();
+  if (this_cpu()->hartid == boot_hartid &&
+      ++bcache_flush_ticks >= BCACHE_FLUSH_TICKS) {
+    bcache_flush_ticks = 0;
+    wakeup(&bcache_flush_ticks);
+  }
+}
+
+void timer_init(void) {
+  timer_set_next();
+  WRITE_CSR(sie, READ_CSR(sie) | SIE_STIE);
 }
 
 __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
@@ -377,6 +1478,7 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
 
                        "addi a0, sp, 4 * 31\n"
                        "csrw sscratch, a0\n"
+                       "lw tp, 0(a0)\n" // struct process's cpu
 
                        "mv a0, sp\n"
                        "call handle_trap\n"
@@ -415,83 +1517,891 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
                        "sret\n");
 }
 
-// handle_syscall is essentially one big switch statement that
-// selects what the syscall is and handles it
-// the syscall number itself is in f->a3, the data is in f->a0
-void handle_syscall(struct trap_frame *f) {
-  switch (f->a3) {
-  case SYS_PUTCHAR:
-    putchar(f->a0);
-    break;
-  case SYS_GETCHAR:
-    while (1) {
-      long ch = getchar();
-      if (ch >= 0) {
-        f->a0 = ch;
-        break;
-      }
+// the registers the C calling convention lets a callee clobber, except t0
+// and a0 which the entry points deal with themselves. s0..s11 survive any C
+// function we call (switch_context included), so the fast paths leave them be.
+#define SAVE_SCRATCH_REGS                                                      \
+  "sw ra,  4 * 0(sp)\n"                                                        \
+  "sw t1,  4 * 4(sp)\n"                                                        \
+  "sw t2,  4 * 5(sp)\n"                                                        \
+  "sw t3,  4 * 6(sp)\n"                                                        \
+  "sw t4,  4 * 7(sp)\n"                                                        \
+  "sw t5,  4 * 8(sp)\n"                                                        \
+  "sw t6,  4 * 9(sp)\n"                                                        \
+  "sw a1,  4 * 11(sp)\n"                                                       \
+  "sw a2,  4 * 12(sp)\n"                                                       \
+  "sw a3,  4 * 13(sp)\n"                                                       \
+  "sw a4,  4 * 14(sp)\n"                                                       \
+  "sw a5,  4 * 15(sp)\n"                                                       \
+  "sw a6,  4 * 16(sp)\n"                                                       \
+  "sw a7,  4 * 17(sp)\n"
+
+#define RESTORE_SCRATCH_REGS                                                   \
+  "lw ra,  4 * 0(sp)\n"                                                        \
+  "lw t1,  4 * 4(sp)\n"                                                        \
+  "lw t2,  4 * 5(sp)\n"                                                        \
+  "lw t3,  4 * 6(sp)\n"                                                        \
+  "lw t4,  4 * 7(sp)\n"                                                        \
+  "lw t5,  4 * 8(sp)\n"                                                        \
+  "lw t6,  4 * 9(sp)\n"                                                        \
+  "lw a1,  4 * 11(sp)\n"                                                       \
+  "lw a2,  4 * 12(sp)\n"                                                       \
+  "lw a3,  4 * 13(sp)\n"                                                       \
+  "lw a4,  4 * 14(sp)\n"                                                       \
+  "lw a5,  4 * 15(sp)\n"                                                       \
+  "lw a6,  4 * 16(sp)\n"                                                       \
+  "lw a7,  4 * 17(sp)\n"
+
+// the user sp and tp go into the frame, sscratch gets the kernel stack top
+// back and tp this hart's struct cpu from right above it, like kernel_entry
+// does
+#define SWITCH_TO_KERNEL_STACK                                                 \
+  "csrr t0, sscratch\n"                                                        \
+  "sw t0,  4 * 30(sp)\n"                                                       \
+  "sw tp,  4 * 2(sp)\n"                                                        \
+  "addi t0, sp, 4 * 31\n"                                                      \
+  "csrw sscratch, t0\n"                                                        \
+  "lw tp,  0(t0)\n"
+
+#define SWITCH_TO_USER_STACK                                                   \
+  "lw tp,  4 * 2(sp)\n"                                                        \
+  "lw sp,  4 * 30(sp)\n"
+
+// synchronous exceptions (stvec base). ecall takes the fast path straight
+// into handle_syscall; anything else backs out and goes through
+// kernel_entry, which saves every register.
+__attribute__((naked)) __attribute__((aligned(4))) void syscall_entry(void) {
+  __asm__ __volatile__("csrrw sp, sscratch, sp\n"
+                       "addi sp, sp, -4 * 31\n"
+                       "sw t0,  4 * 3(sp)\n"
+                       "csrr t0, scause\n"
+                       "addi t0, t0, -8\n" // SCAUSE_ECALL
+                       "beqz t0, 1f\n"
+
+                       "lw t0,  4 * 3(sp)\n"
+                       "addi sp, sp, 4 * 31\n"
+                       "csrrw sp, sscratch, sp\n"
+                       "j kernel_entry\n"
 
-      yield();
+                       "1:\n"
+                       "sw a0,  4 * 10(sp)\n" SAVE_SCRATCH_REGS
+                           SWITCH_TO_KERNEL_STACK
+
+                       "mv a0, sp\n"
+                       "call handle_syscall\n"
+
+                       "lw t0,  4 * 3(sp)\n"
+                       "lw a0,  4 * 10(sp)\n" RESTORE_SCRATCH_REGS
+                           SWITCH_TO_USER_STACK
+                       "sret\n");
+}
+
+// interrupts (stvec vector slots): same short save as syscalls
+__attribute__((naked)) __attribute__((aligned(4))) void interrupt_entry(void) {
+  __asm__ __volatile__("csrrw sp, sscratch, sp\n"
+                       "addi sp, sp, -4 * 31\n"
+                       "sw t0,  4 * 3(sp)\n"
+                       "sw a0,  4 * 10(sp)\n" SAVE_SCRATCH_REGS
+                           SWITCH_TO_KERNEL_STACK
+
+                       "call handle_interrupt\n"
+
+                       "lw t0,  4 * 3(sp)\n"
+                       "lw a0,  4 * 10(sp)\n" RESTORE_SCRATCH_REGS
+                           SWITCH_TO_USER_STACK
+                       "sret\n");
+}
+
+// vectored stvec: exceptions land on slot 0, interrupt `cause` on slot
+// `cause`. every slot must be a single 4-byte jump.
+__attribute__((naked)) __attribute__((aligned(64))) void trap_vector(void) {
+  __asm__ __volatile__(".option push\n"
+                       ".option norvc\n"
+                       "j syscall_entry\n"   // 0: exceptions
+                       "j interrupt_entry\n" // 1: supervisor software
+                       "j interrupt_entry\n" // 2
+                       "j interrupt_entry\n" // 3
+                       "j interrupt_entry\n" // 4
+                       "j interrupt_entry\n" // 5: supervisor timer
+                       "j interrupt_entry\n" // 6
+                       "j interrupt_entry\n" // 7
+                       "j interrupt_entry\n" // 8
+                       "j interrupt_entry\n" // 9: supervisor external
+                       ".option pop\n");
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        mmap and page faults │
+//                                      ────────────────────────────────────────┘
+
+// the mmap region of the current process holding `vaddr`, or NULL
+struct vma *find_vma(vaddr_t vaddr) {
+  for (int i = 0; i < VMA_MAX; i++) {
+    struct vma *vma = &current_proc->vmas[i];
+    if (vma->start && vaddr >= vma->start && vaddr < vma->end)
+      return vma;
+  }
+  return NULL;
+}
+
+// drops any stale translation of one page of the current process. only the
+// ASID in satp is flushed, other processes and the global kernel mappings
+// keep their TLB entries. a process only runs on one hart at a time and
+// flushes again when it moves (see yield), so other harts need no shootdown.
+void flush_tlb_page(vaddr_t vaddr) {
+  uint32_t asid = (READ_CSR(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  __asm__ __volatile__("sfence.vma %0, %1" ::"r"(vaddr), "r"(asid) : "memory");
+}
+
+// first store to a copy-on-write page: give the process its own copy. the
+// last process holding a refcounted page simply keeps it.
+void cow_break(uint32_t *pte, vaddr_t page_va) {
+  paddr_t old = (*pte >> 10) * PAGE_SIZE;
+  uint32_t flags = (*pte & PAGE_X) | PAGE_U | PAGE_R | PAGE_W | PAGE_V;
+  bool shared = *pte & PAGE_SHARED;
+  if (!shared && page_refs(old) == 1) {
+    *pte = ((old / PAGE_SIZE) << 10) | flags;
+  } else {
+    paddr_t page = alloc_pages(1);
+    memcpy((void *)page, (void *)old, PAGE_SIZE);
+    *pte = ((page / PAGE_SIZE) << 10) | flags;
+    if (!shared)
+      page_unref(old);
+  }
+  flush_tlb_page(page_va);
+}
+
+// resolves a user page fault at `vaddr` by mapping the page its region
+// provides: a shared image page (copy-on-write), or a page out of a file's
+// page cache (read-only, or copy-on-write for PROT_WRITE mmaps). a store
+// gets the process its own copy right away. returns false if the access is
+// not allowed.
+bool handle_page_fault(vaddr_t vaddr, bool is_write) {
+  vaddr_t page_va = vaddr & ~(PAGE_SIZE - 1);
+  uint32_t *page_table = current_proc->page_table;
+  if (!page_table)
+    return false; // a kernel thread has no user space to fault in
+  if (vaddr < USER_BASE || vaddr >= USER_TOP)
+    return false;
+  uint32_t *pte = walk_pte(page_table, page_va);
+  if (pte && (*pte & PAGE_V)) {
+    if (!is_write || !(*pte & PAGE_COW))
+      return false; // mapped already, and this access is not allowed
+
+    cow_break(pte, page_va);
+    current_proc->minor_faults++;
+    return true;
+  }
+
+  struct vma *vma = find_vma(vaddr);
+  if (!vma || (is_write && !(vma->prot & PROT_WRITE)))
+    return false;
+
+  uint32_t index = (page_va - vma->start) / PAGE_SIZE;
+  uint32_t flags = PAGE_U | PAGE_R;
+  bool major;
+  paddr_t page;
+  if (vma->type == VMA_IMAGE) {
+    if (vma->prot & PROT_EXEC)
+      flags |= PAGE_X;
+    page = image_get_page(vma->image, index, &major);
+    if (!page) {
+      // bss or stack: a zero page of our own, nothing to share
+      page = alloc_pages(1);
+      if (vma->prot & PROT_WRITE)
+        flags |= PAGE_W;
+      map_page(page_table, page_va, page, flags);
+      flush_tlb_page(page_va);
+      current_proc->minor_faults++;
+      return true;
     }
-    break;
-  case SYS_EXIT:
-    printf("process %d exited\n", current_proc->pid);
-    current_proc->state = PROC_EXITED;
-    yield();
-    PANIC("unreachable");
+    page_ref(page);
+    if (vma->prot & PROT_WRITE)
+      flags |= PAGE_COW;
+  } else {
+    page = fs_get_page(&files[vma->file], index, &major);
+    flags |= PAGE_SHARED;
+    if (vma->prot & PROT_WRITE)
+      flags |= PAGE_COW;
+  }
+  map_page(page_table, page_va, page, flags);
+
+  if (is_write)
+    cow_break(walk_pte(page_table, page_va), page_va);
+  else
+    flush_tlb_page(page_va);
+
+  if (major)
+    current_proc->major_faults++;
+  else
+    current_proc->minor_faults++;
+  return true;
+}
+
+// faults in the pages of [vaddr, vaddr+len) that a region would provide,
+// so that the kernel can access them under sstatus.SUM without trapping
+void user_prefault(vaddr_t vaddr, size_t len, bool is_write) {
+  vaddr_t end = vaddr + len;
+  if (end < vaddr || end > USER_TOP)
+    return; // user_range_ok turns it down
+
+  for (vaddr_t va = vaddr & ~(PAGE_SIZE - 1); va < end; va += PAGE_SIZE) {
+    uint32_t *pte = walk_pte(current_proc->page_table, va);
+    if (!pte || !(*pte & PAGE_V) || (is_write && (*pte & PAGE_COW)))
+      handle_page_fault(va, is_write);
+  }
+}
+
+// copies `len` bytes to user address `dst` of the current process. the
+// whole range has to be mapped writable for user mode; sstatus.SUM lets the
+// kernel touch PAGE_U pages while we copy.
+bool copy_to_user(vaddr_t dst, const void *src, size_t len) {
+  user_prefault(dst, len, true);
+  if (!user_range_ok(current_proc->page_table, dst, len, PAGE_W))
+    return false;
+
+  __asm__ __volatile__("csrs sstatus, %0" ::"r"(SSTATUS_SUM));
+  memcpy((void *)dst, src, len);
+  __asm__ __volatile__("csrc sstatus, %0" ::"r"(SSTATUS_SUM));
+  return true;
+}
+
+// copies `len` bytes from user address `src` of the current process
+bool copy_from_user(void *dst, vaddr_t src, size_t len) {
+  user_prefault(src, len, false);
+  if (!user_range_ok(current_proc->page_table, src, len, PAGE_R))
+    return false;
+
+  __asm__ __volatile__("csrs sstatus, %0" ::"r"(SSTATUS_SUM));
+  memcpy(dst, (const void *)src, len);
+  __asm__ __volatile__("csrc sstatus, %0" ::"r"(SSTATUS_SUM));
+  return true;
+}
+
+// copies a NUL-terminated user string of at most `max` bytes, terminator
+// included. fails if it is longer or runs into an unmapped page.
+bool copy_string_from_user(char *dst, vaddr_t src, size_t max) {
+  for (size_t i = 0; i < max; i++) {
+    if (!copy_from_user(&dst[i], src + i, 1))
+      return false;
+    if (dst[i] == '\0')
+      return true;
+  }
+  return false;
+}
+
+// sys_mmap: maps the file called `name` into the current process. `len_ptr`
+// holds the number of bytes wanted (0 for the whole file) and gets the
+// mapped length back. returns the address of the mapping, or 0.
+vaddr_t sys_mmap(vaddr_t name_ptr, vaddr_t len_ptr, int prot) {
+  char name[sizeof(files->name)];
+  size_t len;
+  if (!copy_string_from_user(name, name_ptr, sizeof(name)) ||
+      !copy_from_user(&len, len_ptr, sizeof(len)))
+    return 0;
+
+  struct file *file = fs_lookup(name);
+  if (!file || !(prot & PROT_READ))
+    return 0;
+  if (len == 0 || len > file->size)
+    len = file->size;
+  if (len == 0 || len > FS_MAP_MAX_PAGES * PAGE_SIZE)
+    return 0;
+
+  vaddr_t start = current_proc->mmap_next;
+  vaddr_t end = start + align_up(len, PAGE_SIZE);
+  if (end > MMAP_TOP)
+    return 0;
+
+  struct vma *vma = NULL;
+  for (int i = 0; i < VMA_MAX && !vma; i++) {
+    if (!current_proc->vmas[i].start)
+      vma = &current_proc->vmas[i];
+  }
+  if (!vma)
+    return 0;
+
+  // the length goes back before anything is reserved, so a len_ptr we
+  // cannot write to costs nothing
+  if (!copy_to_user(len_ptr, &len, sizeof(len)))
+    return 0;
+
+  vma->start = start;
+  vma->end = end;
+  vma->type = VMA_FILE;
+  vma->file = file - files;
+  vma->prot = prot;
+  current_proc->mmap_next = end;
+  return start;
+}
+
+// sys_write: prints `len` bytes from user address `buf` on the console.
+// the buffer is checked once up front and then copied over in chunks.
+// returns the number of bytes written, or -1 if the buffer is not readable.
+int sys_write(vaddr_t buf, size_t len) {
+  user_prefault(buf, len, false);
+  if (!user_range_ok(current_proc->page_table, buf, len, PAGE_R))
+    return -1;
+
+  char chunk[WRITE_CHUNK];
+  for (size_t done = 0; done < len;) {
+    size_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+    __asm__ __volatile__("csrs sstatus, %0" ::"r"(SSTATUS_SUM));
+    memcpy(chunk, (const void *)(buf + done), n);
+    __asm__ __volatile__("csrc sstatus, %0" ::"r"(SSTATUS_SUM));
+
+    // user output skips the kernel log, but must not overtake it
+    flush();
+    console_write(chunk, n);
+    done += n;
+  }
+  return len;
+}
 
-  default:
+// sys_read: blocks until there is console input, then copies up to `len`
+// characters of it to user address `buf`. returns the number copied, or -1.
+int sys_read(vaddr_t buf, size_t len) {
+  user_prefault(buf, len, true);
+  if (!user_range_ok(current_proc->page_table, buf, len, PAGE_W))
+    return -1;
+  if (len == 0)
+    return 0;
+
+  char chunk[UART_RX_SIZE];
+  size_t n = uart_read(chunk, len < sizeof(chunk) ? len : sizeof(chunk));
+
+  // the page table check above still holds, we only slept
+  __asm__ __volatile__("csrs sstatus, %0" ::"r"(SSTATUS_SUM));
+  memcpy((void *)buf, chunk, n);
+  __asm__ __volatile__("csrc sstatus, %0" ::"r"(SSTATUS_SUM));
+  return n;
+}
+
+// sys_fread: copies up to `len` bytes from the start of the file called
+// `name` to user address `buf`. returns the number of bytes copied, or -1.
+int sys_fread(vaddr_t name_ptr, vaddr_t buf, size_t len) {
+  char name[sizeof(files->name)];
+  if (!copy_string_from_user(name, name_ptr, sizeof(name)))
+    return -1;
+  struct file *file = fs_lookup(name);
+  if (!file)
+    return -1;
+
+  char chunk[WRITE_CHUNK];
+  size_t done = 0;
+  while (done < len) {
+    size_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+    n = fs_read(file, done, chunk, n);
+    if (n == 0)
+      break;
+    if (!copy_to_user(buf + done, chunk, n))
+      return -1;
+    done += n;
+  }
+  return done;
+}
+
+// sys_fwrite: overwrites the start of the file called `name` with `len`
+// bytes from user address `buf`. files never grow this way, so user space
+// cannot run the kernel out of memory or the disk out of space. the data
+// sits in the buffer cache until the next sync. returns `len`, or -1.
+int sys_fwrite(vaddr_t name_ptr, vaddr_t buf, size_t len) {
+  char name[sizeof(files->name)];
+  if (!copy_string_from_user(name, name_ptr, sizeof(name)))
+    return -1;
+  struct file *file = fs_lookup(name);
+  if (!file || len > file->size)
+    return -1;
+
+  char chunk[WRITE_CHUNK];
+  for (size_t done = 0; done < len;) {
+    size_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+    if (!copy_from_user(chunk, buf + done, n))
+      return -1;
+    fs_write(file, done, chunk, n);
+    done += n;
+  }
+  return len;
+}
+
+// sys_dmesg: copies the most recent kernel log, at most `len` bytes, to user
+// address `buf`. returns the number of bytes copied, or -1.
+int sys_dmesg(vaddr_t buf, size_t len) {
+  uint32_t end = __atomic_load_n(&klog_commit, __ATOMIC_ACQUIRE);
+  uint32_t kept = end < KLOG_SIZE ? end : KLOG_SIZE;
+  if (len > kept)
+    len = kept;
+
+  uint32_t start = end - len;
+  uint32_t off = start % KLOG_SIZE;
+  uint32_t first = len < KLOG_SIZE - off ? len : KLOG_SIZE - off;
+  if (!copy_to_user(buf, &klog_buf[off], first) ||
+      !copy_to_user(buf + first, klog_buf, len - first))
+    return -1;
+  return len;
+}
+
+// syscall handlers, one per table slot. arguments come in f->a0..a2, the
+// result goes back in f->a0.
+void syscall_putchar(struct trap_frame *f) {
+  char ch = f->a0;
+  flush();
+  console_write(&ch, 1);
+}
+
+void syscall_getchar(struct trap_frame *f) {
+  char ch;
+  uart_read(&ch, 1);
+  f->a0 = (uint8_t)ch;
+}
+
+void syscall_exit(struct trap_frame *f) {
+  printf("process %d exited with status %d\n", current_proc->pid, f->a0);
+  proc_exit();
+}
+
+void syscall_spawn(struct trap_frame *f) {
+  struct process *proc = spawn_process(f->a0);
+  f->a0 = proc ? proc->pid : -1;
+}
+
+void syscall_wait(struct trap_frame *f) {
+  wait_children();
+  f->a0 = 0;
+}
+
+void syscall_nice(struct trap_frame *f) {
+  f->a0 = proc_nice(current_proc, f->a0);
+}
+
+void syscall_sync(struct trap_frame *f) {
+  f->a0 = fs_flush() ? 0 : -1;
+}
+
+void syscall_bcache_stats(struct trap_frame *f) {
+  struct bcache_stats stats;
+  bcache_get_stats(&stats);
+  f->a0 = copy_to_user(f->a0, &stats, sizeof(stats)) ? 0 : -1;
+}
+
+void syscall_mmap(struct trap_frame *f) {
+  f->a0 = sys_mmap(f->a0, f->a1, f->a2);
+}
+
+void syscall_write(struct trap_frame *f) {
+  f->a0 = sys_write(f->a0, f->a1);
+}
+
+void syscall_fread(struct trap_frame *f) {
+  f->a0 = sys_fread(f->a0, f->a1, f->a2);
+}
+
+void syscall_fwrite(struct trap_frame *f) {
+  f->a0 = sys_fwrite(f->a0, f->a1, f->a2);
+}
+
+void syscall_dmesg(struct trap_frame *f) {
+  f->a0 = sys_dmesg(f->a0, f->a1);
+}
+
+void syscall_read(struct trap_frame *f) { f->a0 = sys_read(f->a0, f->a1); }
+
+void syscall_fault_stats(struct trap_frame *f) {
+  struct fault_stats stats = {.major = current_proc->major_faults,
+                              .minor = current_proc->minor_faults};
+  f->a0 = copy_to_user(f->a0, &stats, sizeof(stats)) ? 0 : -1;
+}
+
+// does nothing, for measuring the cost of getting in and out of the kernel
+void syscall_null(struct trap_frame *f) { f->a0 = 0; }
+
+syscall_fn syscall_table[SYS_MAX] = {
+    [SYS_PUTCHAR] = syscall_putchar,
+    [SYS_GETCHAR] = syscall_getchar,
+    [SYS_EXIT] = syscall_exit,
+    [SYS_NICE] = syscall_nice,
+    [SYS_SYNC] = syscall_sync,
+    [SYS_BCACHE_STATS] = syscall_bcache_stats,
+    [SYS_MMAP] = syscall_mmap,
+    [SYS_WRITE] = syscall_write,
+    [SYS_DMESG] = syscall_dmesg,
+    [SYS_READ] = syscall_read,
+    [SYS_NULL] = syscall_null,
+    [SYS_FAULT_STATS] = syscall_fault_stats,
+    [SYS_SPAWN] = syscall_spawn,
+    [SYS_WAIT] = syscall_wait,
+    [SYS_FREAD] = syscall_fread,
+    [SYS_FWRITE] = syscall_fwrite,
+};
+
+// called from syscall_entry. the syscall number is in f->a3, the arguments
+// in f->a0..a2. only the registers the C calling convention lets us clobber
+// are in the frame. like the other trap handlers it runs under the kernel
+// lock.
+void handle_syscall(struct trap_frame *f) {
+  lock_kernel();
+  uint32_t user_pc = READ_CSR(sepc);
+  if (f->a3 >= SYS_MAX || !syscall_table[f->a3])
     PANIC("unexpected syscall a3=%x\n", f->a3);
+
+  syscall_table[f->a3](f);
+
+  // something we woke up should run before we go back to user mode
+  if (need_resched)
+    yield();
+
+  flush();
+  WRITE_CSR(sepc, user_pc + 4);
+  unlock_kernel();
+}
+
+// claim and dispatch every pending device interrupt
+void handle_external_interrupt(void) {
+  uint32_t irq;
+  while ((irq = plic_claim()) != 0) {
+    if (irq == VIRTIO_BLK_IRQ)
+      virtio_blk_interrupt();
+    else if (irq == UART_IRQ)
+      uart_interrupt();
+    else
+      printf("plic: unexpected irq %d\n", irq);
+    plic_complete(irq);
   }
 }
 
+// the kernel itself always runs with sstatus.SIE clear, so interrupts are
+// only taken as traps from user mode. when the kernel has to wait it parks
+// the hart with wfi (which wakes up on any interrupt enabled in sie) and
+// handles whatever is pending by hand.
+// the kernel lock is dropped around the wfi so the other harts can get on
+// with it meanwhile. device interrupts only go to the boot hart, the others
+// wake up for their timer and for IPIs from make_runnable.
+void wait_for_interrupt(void) {
+  flush(); // nothing better to do than catching up on the log
+  drop_borrowed_page_table();
+  unlock_kernel();
+  __asm__ __volatile__("wfi");
+  lock_kernel();
+  if (READ_CSR(sip) & SIP_STIP)
+    timer_tick(); // nothing to preempt, just count the tick
+  if (READ_CSR(sip) & SIP_SSIP)
+    WRITE_CSR(sip, READ_CSR(sip) & ~SIP_SSIP); // the caller yields anyway
+  if (this_cpu()->hartid == boot_hartid)
+    handle_external_interrupt();
+}
+
 // handle traps including syscalls using trap_frame
+// interrupts, from interrupt_entry
+void handle_interrupt(void) {
+  lock_kernel();
+  uint32_t scause = READ_CSR(scause);
+  uint32_t user_pc = READ_CSR(sepc);
+  if (scause == SCAUSE_EXTERNAL_INTR) {
+    handle_external_interrupt();
+  } else if (scause == SCAUSE_SOFTWARE_INTR) {
+    // another hart queued something for us, need_resched is set
+    WRITE_CSR(sip, READ_CSR(sip) & ~SIP_SSIP);
+  } else if (scause == SCAUSE_TIMER_INTR) {
+    // end of the time slice: rearm and let someone else run
+    timer_tick();
+    preempt();
+  } else {
+    PANIC("unexpected interrupt scause=%x, sepc=%x\n", scause, user_pc);
+  }
+
+  // something we woke up should run before we go back to user mode
+  if (need_resched)
+    yield();
+
+  flush();
+  WRITE_CSR(sepc, user_pc);
+  unlock_kernel();
+}
+
+// every exception other than ecall, from kernel_entry with all registers
+// saved in `f`
 void handle_trap(struct trap_frame *f) {
+  lock_kernel();
   uint32_t scause = READ_CSR(scause);
   uint32_t stval = READ_CSR(stval);
   uint32_t user_pc = READ_CSR(sepc);
-  if (scause == SCAUSE_ECALL) {
-    handle_syscall(f);
+  if (scause == SCAUSE_LOAD_PAGE_FAULT || scause == SCAUSE_STORE_PAGE_FAULT ||
+      scause == SCAUSE_INST_PAGE_FAULT) {
+    if (!handle_page_fault(stval, scause == SCAUSE_STORE_PAGE_FAULT)) {
+      printf("process %d: bad access to %x at sepc=%x ra=%x\n",
+             current_proc->pid, stval, user_pc, f->ra);
+      proc_exit();
+    }
+#ifdef BENCH
+  } else if (scause == SCAUSE_BREAKPOINT) {
+    // the shell's trap benchmark: a null round trip through this full path
     user_pc += 4;
+#endif
   } else {
-    PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval,
-          user_pc);
+    PANIC("unexpected trap scause=%x, stval=%x, sepc=%x, ra=%x\n", scause,
+          stval, user_pc, f->ra);
   }
 
+  // something we woke up should run before we go back to user mode
+  if (need_resched)
+    yield();
+
+  flush();
+
   WRITE_CSR(sepc, user_pc);
+  unlock_kernel();
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        memcpy / memset │
+//                                      ────────────────────────────────────────┘
+
+// switch memcpy/memset over to the vector versions if this hart has RVV.
+// sstatus.VS is read-only zero without the V extension, so turning the
+// vector unit on and reading it back tells us whether it exists. it is
+// switched off again right away, the vector versions turn it on themselves.
+void memops_init(void) {
+  __asm__ __volatile__("csrs sstatus, %0" ::"r"(SSTATUS_VS_INITIAL));
+  mem_use_rvv = (READ_CSR(sstatus) & SSTATUS_VS) != 0;
+  __asm__ __volatile__("csrc sstatus, %0" ::"r"(SSTATUS_VS));
+  printf("memops: using %s memcpy/memset\n",
+         mem_use_rvv ? "vector" : "word-wide");
+}
+
+#ifdef BENCH
+// time one memcpy or memset case and print bytes/cycle (two decimals)
+void memops_bench_one(const char *name, uint8_t *dst, uint8_t *src,
+                      size_t size) {
+  unsigned reps = (1024 * 1024) / size;
+  uint32_t start = READ_CSR(cycle);
+  for (unsigned i = 0; i < reps; i++) {
+    if (src)
+      memcpy(dst, src, size);
+    else
+      memset(dst, i, size);
+  }
+  uint32_t cycles = READ_CSR(cycle) - start;
+  if (cycles == 0)
+    cycles = 1;
+
+  unsigned bpc = (reps * size) * 100 / cycles;
+  printf("  %s size=%d dst+%d src+%d: %d.%d%d bytes/cycle\n", name, size,
+         (uint32_t)dst % 8, src ? (uint32_t)src % 8 : 0, bpc / 100,
+         (bpc / 10) % 10, bpc % 10);
+}
+
+// memcpy/memset throughput for a few sizes and alignments, once with the
+// word-wide versions and once with the vector versions if available
+void memops_bench(void) {
+  static const size_t sizes[] = {16, 64, 256, 4096, 65536};
+  static const unsigned offsets[][2] = {{0, 0}, {1, 1}, {0, 3}};
+  uint8_t *dst = (uint8_t *)alloc_pages(65536 / PAGE_SIZE + 1);
+  uint8_t *src = (uint8_t *)alloc_pages(65536 / PAGE_SIZE + 1);
+
+  bool has_rvv = mem_use_rvv;
+  for (int rvv = 0; rvv <= has_rvv; rvv++) {
+    mem_use_rvv = rvv;
+    printf("memops bench (%s):\n", rvv ? "vector" : "word-wide");
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      for (unsigned j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+        memops_bench_one("memcpy", dst + offsets[j][0], src + offsets[j][1],
+                         sizes[i]);
+      }
+      memops_bench_one("memset", dst, NULL, sizes[i]);
+      memops_bench_one("memset", dst + 1, NULL, sizes[i]);
+    }
+  }
+  mem_use_rvv = has_rvv;
+
+  free_pages((paddr_t)dst, 65536 / PAGE_SIZE + 1);
+  free_pages((paddr_t)src, 65536 / PAGE_SIZE + 1);
+}
+
+#define ASID_BENCH_PAGES 16 // user pages touched after every switch
+#define ASID_BENCH_ROUNDS 4096
+
+// what a context switch costs in TLB refills: flip satp between two address
+// spaces and read a few user pages in each, once flushing everything around
+// every switch as yield did before ASIDs, once with ASID-tagged satp writes
+void asid_bench(void) {
+  if (asid_bits == 0) {
+    printf("asid bench: no ASIDs on this hart\n");
+    return;
+  }
+
+  uint32_t *tables[2];
+  for (int t = 0; t < 2; t++) {
+    tables[t] = alloc_page_table();
+    for (int p = 0; p < ASID_BENCH_PAGES; p++)
+      map_page(tables[t], USER_BASE + p * PAGE_SIZE, alloc_pages(1),
+               PAGE_U | PAGE_R | PAGE_W);
+  }
+
+  WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SUM);
+  uint32_t cycles[2];
+  for (int tagged = 0; tagged <= 1; tagged++) {
+    uint32_t start = READ_CSR(cycle);
+    for (int i = 0; i < ASID_BENCH_ROUNDS; i++) {
+      uint32_t *table = tables[i & 1];
+      uint32_t asid = tagged ? (i & 1) + 1 : 0;
+      if (!tagged)
+        __asm__ __volatile__("sfence.vma" ::: "memory");
+      WRITE_CSR(satp, SATP_SV32 | (asid << SATP_ASID_SHIFT) |
+                          ((uint32_t)table / PAGE_SIZE));
+      if (!tagged)
+        __asm__ __volatile__("sfence.vma" ::: "memory");
+      for (int p = 0; p < ASID_BENCH_PAGES; p++)
+        (void)*(volatile uint32_t *)(USER_BASE + p * PAGE_SIZE);
+    }
+    cycles[tagged] = (READ_CSR(cycle) - start) / ASID_BENCH_ROUNDS;
+  }
+  WRITE_CSR(sstatus, READ_CSR(sstatus) & ~SSTATUS_SUM);
+
+  // back to bare, and forget the two ASIDs before the allocator hands them out
+  WRITE_CSR(satp, 0);
+  __asm__ __volatile__("sfence.vma" ::: "memory");
+  for (int t = 0; t < 2; t++)
+    free_page_table(tables[t]);
+
+  printf("asid bench: %d cycles per switch flushing the TLB, %d with ASIDs\n",
+         cycles[0], cycles[1]);
 }
+#endif
 
-// boot jumps here
-void kernel_main(void) {
+// every hart ends up here for good: run whatever is runnable, zero pages
+// for later allocations while there is nothing, then sleep until an
+// interrupt makes someone runnable again
+void idle_loop(void) {
+  for (;;) {
+    yield();
+    zero_pool_refill();
+    wait_for_interrupt();
+  }
+}
+
+// per-hart trap and interrupt setup, the same on every hart
+void hart_init(void) {
+  WRITE_CSR(stvec, (uint32_t)trap_vector | STVEC_MODE_VECTORED);
+#ifdef BENCH
+  // let user mode read the cycle and time counters for the shell's benchmarks
+  WRITE_CSR(scounteren, SCOUNTEREN_CY | SCOUNTEREN_TM);
+#endif
+  WRITE_CSR(sie, READ_CSR(sie) | SIE_SSIE);
+}
+
+// a secondary hart comes here from secondary_boot with tp already set
+void secondary_main(void) {
+  hart_init();
+  lock_kernel();
+  create_idle_process();
+  timer_init();
+  printf("hart %d up\n", this_cpu()->hartid);
+  idle_loop();
+}
+
+// the SBI starts a hart here in S-mode with paging off, its hart id in a0
+// and its struct cpu in a1
+__attribute__((naked)) __attribute__((aligned(4))) void secondary_boot(void) {
+  __asm__ __volatile__("mv tp, a1\n"
+                       "lw sp, 0(a1)\n" // cpu->stack_top
+                       "j secondary_main\n");
+}
+
+// start every other hart the SBI has, up to HARTS_MAX in all. they wait for
+// the kernel lock until the boot hart goes idle.
+void smp_init(void) {
+  struct sbiret ret = sbi_call(SBI_EXT_HSM, 0, 0, 0, 0, 0, SBI_BASE_PROBE_EXT,
+                               SBI_EXT_BASE);
+  if (ret.error != 0 || ret.value == 0)
+    return;
+
+  for (uint32_t hartid = 0; hartid < SBI_HSM_HARTS && ncpus < HARTS_MAX;
+       hartid++) {
+    ret = sbi_call(hartid, 0, 0, 0, 0, 0, SBI_HSM_HART_STATUS, SBI_EXT_HSM);
+    if (ret.error != 0 || ret.value != SBI_HSM_STOPPED)
+      continue;
+
+    struct cpu *cpu = &cpus[ncpus++];
+    cpu->hartid = hartid;
+    cpu->stack_top =
+        alloc_pages(HART_STACK_PAGES) + HART_STACK_PAGES * PAGE_SIZE;
+    ret = sbi_call(hartid, (uint32_t)secondary_boot, (uint32_t)cpu, 0, 0, 0,
+                   SBI_HSM_HART_START, SBI_EXT_HSM);
+    if (ret.error != 0) {
+      printf("smp: hart %d did not start (%d)\n", hartid, ret.error);
+      ncpus--;
+    }
+  }
+}
+
+// boot jumps here, the SBI passes our hart id in a0
+void kernel_main(uint32_t hartid) {
   memset(__bss, 0, (size_t)__bss_end - (size_t)__bss);
+  boot_hartid = hartid;
+  cpu_init(hartid);
+  lock_kernel();
+  console_init();
   printf("\n\n");
-  WRITE_CSR(stvec, (uint32_t)kernel_entry);
+  hart_init();
+
+  memops_init();
+
+  // init the page allocator and the shared kernel mappings
+  page_alloc_init();
+  kernel_page_table_init();
+  asid_init();
+#ifdef BENCH
+  memops_bench();
+  asid_bench();
+#endif
+
+  // route device interrupts to us and start the scheduler tick
+  plic_init();
+  uart_init();
+  timer_init();
 
   // init virtio
   virtio_blk_init();
+  page_reclaim_hook = bcache_shrink;
   // init fs
   fs_init();
   char buf[SECTOR_SIZE];
-  read_write_disk(buf, 0, false /* read from the disk */);
+  bcache_read(0, buf);
   printf("first sector: %s\n", buf);
 
   strcpy(buf, "hello from kernel!!!\n");
-  read_write_disk(buf, 0, true /* write to the disk */);
+  bcache_write(0, buf);
+  bcache_sync();
+
+  create_idle_process();
+
+  create_process(_binary_shell_exe_start, (size_t)_binary_shell_exe_size);
+  create_kernel_thread(bcache_flusher, NULL);
 
-  idle_proc = create_process(NULL, 0);
-  idle_proc->pid = 0; // idle
-  current_proc = idle_proc;
+  struct page_stats stats;
+  page_stats(&stats);
+  printf("memory: %d pages free, %d used, %d fragmented\n", stats.free,
+         stats.used, stats.fragmented);
+  printf("memory: zero pool %d pages, %d hits, %d misses\n", stats.zeroed,
+         stats.zero_hits, stats.zero_misses);
 
-  create_process(_binary_shell_bin_start, (size_t)_binary_shell_bin_size);
-  yield();
+  smp_init();
+  printf("smp: %d harts\n", ncpus);
 
-  PANIC("switched to idle process");
+  // we are the boot hart's idle thread from here on
+  idle_loop();
 }
 
 // main booting function
 __attribute__((section(".text.boot"))) __attribute__((naked)) void boot(void) {
-  __asm__ __volatile__("mv sp, %[stack_top]\n"
-                       "j kernel_main\n"
-                       :
-                       : [stack_top] "r"(__stack_top));
+  // la instead of an "r" operand: the compiler could pick a0 for it, and a0
+  // still holds our hart id
+  __asm__ __volatile__("la sp, __stack_top\n"
+                       "j kernel_main\n");
 }
@@ -10,7 +10,7 @@
 // trap defines
 
 // processes
-#define PROCS_MAX 8
+#define PROCS_MAX 16
 #define PROC_UNUSED 0
 #define PROC_RUNNABLE 1
 #define PROC_EXITED 2
@@ -18,7 +18,46 @@
 #define SATP_SV32 (1u << 31)
 #define SSTATUS_SPIE (1 << 5)
 #define SSTATUS_SUM (1 << 18)
+#define SCAUSE_BREAKPOINT 3
 #define SCAUSE_ECALL 8
+#define SCAUSE_INST_PAGE_FAULT 12
+#define SCAUSE_LOAD_PAGE_FAULT 13
+#define SCAUSE_STORE_PAGE_FAULT 15
+#define SCAUSE_EXTERNAL_INTR 0x80000009 // supervisor external interrupt
+#define SCAUSE_TIMER_INTR 0x80000005    // supervisor timer interrupt
+#define SCAUSE_SOFTWARE_INTR 0x80000001 // supervisor software interrupt (IPI)
+#define SIE_SEIE (1 << 9)
+#define STVEC_MODE_VECTORED 1 // interrupts jump to base + 4 * cause
+#define SCOUNTEREN_CY (1 << 0) // user mode may read the cycle counter
+#define SCOUNTEREN_TM (1 << 1) // and the time counter
+#define SIE_SSIE (1 << 1)
+#define SIP_SSIP (1 << 1)
+#define SIE_STIE (1 << 5)
+#define SIP_STIP (1 << 5)
+// timer
+#define TIMEBASE_HZ 10000000 // qemu virt time CSR frequency
+#ifndef TIME_SLICE_MS
+#define TIME_SLICE_MS 10 // preempt a user process after this long
+#endif
+// sbi
+#define SBI_EXT_TIME 0x54494d45
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_EXT_BASE 0x10
+#define SBI_BASE_PROBE_EXT 3
+#define SBI_EXT_DBCN 0x4442434e
+#define SBI_DBCN_WRITE 0
+#define SBI_EXT_IPI 0x735049
+#define SBI_IPI_SEND 0
+#define SBI_EXT_HSM 0x48534d
+#define SBI_HSM_HART_START 0
+#define SBI_HSM_HART_STATUS 2
+#define SBI_HSM_STOPPED 1
+#define SBI_HSM_HARTS 32 // hart ids smp_init asks the SBI about
+// PLIC registers (PLIC_PADDR is in common.h), S-mode context of hart h is 2h+1
+#define PLIC_PRIORITY(irq) (PLIC_PADDR + (irq) * 4)
+#define PLIC_SENABLE(hart) (PLIC_PADDR + 0x2080 + (hart) * 0x100)
+#define PLIC_STHRESHOLD(hart) (PLIC_PADDR + 0x201000 + (hart) * 0x2000)
+#define PLIC_SCLAIM(hart) (PLIC_PADDR + 0x201004 + (hart) * 0x2000)
 // page mapping
 #define PAGE_V (1 << 0)
 #define PAGE_R (1 << 1)
@@ -31,15 +70,22 @@
 #define VIRTQ_ENTRY_NUM 16
 #define VIRTIO_DEVICE_BLK 2
 #define VIRTIO_BLK_PADDR 0x10001000
+#define VIRTIO_BLK_IRQ 1
 #define VIRTIO_REG_MAGIC 0x00
 #define VIRTIO_REG_VERSION 0x04
 #define VIRTIO_REG_DEVICE_ID 0x08
+#define VIRTIO_REG_HOST_FEATURES 0x10
+#define VIRTIO_REG_HOST_FEATURES_SEL 0x14
+#define VIRTIO_REG_GUEST_FEATURES 0x20
+#define VIRTIO_REG_GUEST_FEATURES_SEL 0x24
 #define VIRTIO_REG_QUEUE_SEL 0x30
 #define VIRTIO_REG_QUEUE_NUM_MAX 0x34
 #define VIRTIO_REG_QUEUE_NUM 0x38
 #define VIRTIO_REG_QUEUE_ALIGN 0x3c
 #define VIRTIO_REG_QUEUE_PFN 0x40
 #define VIRTIO_REG_QUEUE_NOTIFY 0x50
+#define VIRTIO_REG_INTERRUPT_STATUS 0x60
+#define VIRTIO_REG_INTERRUPT_ACK 0x64
 #define VIRTIO_REG_DEVICE_STATUS 0x70
 #define VIRTIO_REG_DEVICE_CONFIG 0x100
 #define VIRTIO_STATUS_ACK 1
@@ -51,6 +97,11 @@
 #define VIRTQ_AVAIL_F_NO_INTERRUPT 1
 #define VIRTIO_BLK_T_IN 0
 #define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_F_SIZE_MAX (1 << 1) // config.size_max limits a segment
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)  // config.seg_max limits segments/request
+#define VIRTIO_BLK_S_IOERR 1
+// every request takes at least 3 descriptors: header, data, status
+#define BLK_MAX_INFLIGHT (VIRTQ_ENTRY_NUM / 3)
 
 ///////////////////////////////////////////////////////////////
 /// virtq
@@ -91,17 +142,69 @@ struct virtio_virtq {
   int queue_index;
   volatile uint16_t *used_index;
   uint16_t last_used_index;
+  uint16_t free_head; // first free descriptor, chained through `next`
+  uint16_t num_free;  // number of descriptors on the free list
 } __attribute__((packed));
 
-// virtio-blk request
+// virtio-blk request header and status byte. the data in between is described
+// by separate descriptors pointing at the caller's buffer.
 struct virtio_blk_req {
   uint32_t type;
   uint32_t reserved;
   uint64_t sector;
-  uint8_t data[512];
   uint8_t status;
 } __attribute__((packed));
 
+// driver-side view of a block request, owned by the caller until done
+struct blk_request {
+  void *buf;          // count * SECTOR_SIZE bytes to read into / write from
+  uint8_t **segs;     // or, if set, one SECTOR_SIZE buffer per sector
+  unsigned sector;    // first sector on the device
+  unsigned count;     // number of sectors
+  bool is_write;      // VIRTIO_BLK_T_OUT instead of VIRTIO_BLK_T_IN
+  volatile bool done; // set once the completion has been reaped
+  uint8_t status;     // virtio-blk status, 0 on success
+};
+
+// uart (16550 on qemu virt)
+#define UART_IRQ 10
+#define UART_RBR 0          // receive buffer
+#define UART_IER 1          // interrupt enable
+#define UART_LSR 5          // line status
+#define UART_IER_RX (1 << 0) // interrupt when data arrives
+#define UART_LSR_DR (1 << 0) // receive buffer holds data
+#define UART_RX_SIZE 256    // input ring, a power of two
+
+// console
+#define WRITE_CHUNK 128 // bytes SYS_WRITE/FREAD/FWRITE copy at a time
+#define KLOG_SIZE 16384 // kernel log ring, a power of two
+
+// buffer cache
+#define BCACHE_MAX 256      // sector buffers the cache may grow to (128KB)
+#define BCACHE_HASH_SIZE 64 // hash chains, keyed by sector
+#define BCACHE_FLUSH_TICKS 100 // timer ticks between background write-backs
+#define BUFS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+#define BUF_VALID (1 << 0) // data holds the sector contents
+#define BUF_DIRTY (1 << 1) // data is newer than the disk
+#define BUF_BUSY (1 << 2)  // I/O in flight, wait before touching data
+#define BUF_HASHED (1 << 3) // on the hash chain of its sector
+
+// one cached sector
+struct buf {
+  unsigned sector;
+  int flags;                  // BUF_*
+  int refcnt;                 // users between bget/bread and brelse
+  uint8_t *data;              // SECTOR_SIZE bytes inside a shared page
+  struct buf *hash_next;      // next buffer on the same hash chain
+  struct buf *lru_prev;       // LRU list, most recently used first
+  struct buf *lru_next;
+  struct blk_request req;     // read or write-back in flight
+};
+
+// handles one syscall, see syscall_table
+struct trap_frame;
+typedef void (*syscall_fn)(struct trap_frame *f);
+
 struct sbiret {
   long error;
   long value;
@@ -0,0 +1,376 @@
+// ░█▄█░█▀▀░█▄█░█▀█░█▀▄░█░█░░░░█▀▀
+// ░█░█░█▀▀░█░█░█░█░█▀▄░░█░░░░░█░░
+// ░▀░▀░▀▀▀░▀░▀░▀▀▀░▀░▀░░▀░░▀░░▀▀▀
+// memory.c
+// buddy page allocator over __free_ram..__free_ram_end and Sv32 page tables
+
+#include "memory.h"
+
+// the first pages of free ram hold page_map, the rest is handed out in
+// power-of-two blocks. a block of order k starting at page index i always has
+// i aligned to 2^k, so its buddy is simply i ^ 2^k.
+struct page *page_map;   // one entry per page in [ram_base, ram_base+ram_pages)
+paddr_t ram_base;        // physical address of page index 0
+uint32_t ram_pages;      // number of pages managed by the allocator
+uint32_t ram_free_pages; // pages currently sitting on a free list
+
+struct page *free_lists[BUDDY_MAX_ORDER + 1]; // one list of block heads per order
+uint32_t free_counts[BUDDY_MAX_ORDER + 1];    // blocks on each list
+
+struct page *paddr_to_page(paddr_t paddr) {
+  return &page_map[(paddr - ram_base) / PAGE_SIZE];
+}
+
+paddr_t page_to_paddr(struct page *page) {
+  return ram_base + (uint32_t)(page - page_map) * PAGE_SIZE;
+}
+
+// push a block head on the free list of its order
+void free_list_push(struct page *page, uint32_t order) {
+  page->order = order;
+  page->flags |= PG_FREE;
+  page->prev = NULL;
+  page->next = free_lists[order];
+  if (page->next)
+    page->next->prev = page;
+  free_lists[order] = page;
+  free_counts[order]++;
+  ram_free_pages += 1u << order;
+}
+
+// unlink a block head from the free list of its order
+void free_list_remove(struct page *page, uint32_t order) {
+  if (page->prev)
+    page->prev->next = page->next;
+  else
+    free_lists[order] = page->next;
+  if (page->next)
+    page->next->prev = page->prev;
+  page->flags &= ~PG_FREE;
+  free_counts[order]--;
+  ram_free_pages -= 1u << order;
+}
+
+// take a block of 2^order pages, splitting a larger one if needed
+// returns 0 when no block is big enough
+paddr_t buddy_alloc(uint32_t order) {
+  uint32_t o = order;
+  while (o <= BUDDY_MAX_ORDER && !free_lists[o])
+    o++;
+  if (o > BUDDY_MAX_ORDER)
+    return 0;
+
+  struct page *page = free_lists[o];
+  free_list_remove(page, o);
+
+  // hand the upper halves back until the block has the requested size
+  while (o > order) {
+    o--;
+    free_list_push(page + (1u << o), o);
+  }
+
+  page->order = order;
+  return page_to_paddr(page);
+}
+
+// give a block of 2^order pages back, merging it with its buddy as long as
+// the buddy is free and of the same size
+void buddy_free(paddr_t paddr, uint32_t order) {
+  uint32_t index = (paddr - ram_base) / PAGE_SIZE;
+  while (order < BUDDY_MAX_ORDER) {
+    uint32_t buddy = index ^ (1u << order);
+    if (buddy + (1u << order) > ram_pages)
+      break;
+
+    struct page *page = &page_map[buddy];
+    if (!(page->flags & PG_FREE) || page->order != order)
+      break;
+
+    free_list_remove(page, order);
+    index &= ~(1u << order);
+    order++;
+  }
+
+  free_list_push(&page_map[index], order);
+}
+
+// free an arbitrary run of pages by splitting it into the largest aligned
+// blocks that fit
+void buddy_free_range(paddr_t paddr, uint32_t n) {
+  uint32_t index = (paddr - ram_base) / PAGE_SIZE;
+  while (n > 0) {
+    uint32_t order = 0;
+    while (order < BUDDY_MAX_ORDER && (index & (1u << order)) == 0 &&
+           (2u << order) <= n)
+      order++;
+
+    buddy_free(ram_base + index * PAGE_SIZE, order);
+    index += 1u << order;
+    n -= 1u << order;
+  }
+}
+
+// set up page_map at the start of free ram and put everything else on the
+// free lists
+void page_alloc_init(void) {
+  uint32_t total = ((paddr_t)__free_ram_end - (paddr_t)__free_ram) / PAGE_SIZE;
+  uint32_t map_pages =
+      align_up(total * sizeof(struct page), PAGE_SIZE) / PAGE_SIZE;
+
+  page_map = (struct page *)__free_ram;
+  ram_base = (paddr_t)__free_ram + map_pages * PAGE_SIZE;
+  ram_pages = total - map_pages;
+  memset(page_map, 0, ram_pages * sizeof(struct page));
+
+  buddy_free_range(ram_base, ram_pages);
+}
+
+// single pages zeroed ahead of time by the idle loop
+paddr_t zero_pool[ZERO_POOL_MAX];
+uint32_t zero_pool_count;
+uint32_t zero_pool_hits;   // single-page allocations served from the pool
+uint32_t zero_pool_misses; // single-page allocations zeroed synchronously
+
+// top the pool up with freshly zeroed pages, called when the cpu is idle
+void zero_pool_refill(void) {
+  while (zero_pool_count < ZERO_POOL_MAX) {
+    paddr_t paddr = buddy_alloc(0);
+    if (!paddr)
+      break;
+
+    memset((void *)paddr, 0, PAGE_SIZE);
+    zero_pool[zero_pool_count++] = paddr;
+  }
+}
+
+// hand every pooled page back to the buddy allocator
+void zero_pool_drain(void) {
+  while (zero_pool_count > 0)
+    buddy_free(zero_pool[--zero_pool_count], 0);
+}
+
+// smallest order whose block holds n pages
+uint32_t pages_to_order(uint32_t n) {
+  uint32_t order = 0;
+  while ((1u << order) < n)
+    order++;
+  return order;
+}
+
+// called when memory runs out, before giving up; see bcache_shrink. any
+// alloc_pages caller may be in the middle of a page table update, so the
+// hook must not sleep or start I/O.
+void (*page_reclaim_hook)(void);
+
+// allocate n contiguous pages and zero them out
+// the block is rounded up to a power of two internally and the unused tail
+// goes straight back to the free lists, so free_pages(paddr, n) is the exact
+// inverse
+// single pages come from the zero pool when it has any
+paddr_t alloc_pages(uint32_t n) {
+  if (n == 1) {
+    if (zero_pool_count > 0) {
+      zero_pool_hits++;
+      paddr_t paddr = zero_pool[--zero_pool_count];
+      paddr_to_page(paddr)->refs = 1;
+      return paddr;
+    }
+    zero_pool_misses++;
+  }
+
+  uint32_t order = pages_to_order(n);
+  if (order > BUDDY_MAX_ORDER)
+    PANIC("alloc_pages: %d pages is too large", n);
+
+  paddr_t paddr = buddy_alloc(order);
+  if (!paddr) {
+    // pooled pages are free memory too, give them back and retry
+    zero_pool_drain();
+    paddr = buddy_alloc(order);
+  }
+  if (!paddr && page_reclaim_hook) {
+    // so are clean cache pages
+    page_reclaim_hook();
+    paddr = buddy_alloc(order);
+  }
+  if (!paddr)
+    PANIC("out of memory");
+
+  if ((1u << order) > n)
+    buddy_free_range(paddr + n * PAGE_SIZE, (1u << order) - n);
+
+  for (uint32_t i = 0; i < n; i++)
+    paddr_to_page(paddr + i * PAGE_SIZE)->refs = 1;
+
+  memset((void *)paddr, 0, n * PAGE_SIZE);
+  return paddr;
+}
+
+// give n pages starting at paddr back to the allocator
+void free_pages(paddr_t paddr, uint32_t n) {
+  if (!is_aligned(paddr, PAGE_SIZE) || paddr < ram_base ||
+      paddr + n * PAGE_SIZE > ram_base + ram_pages * PAGE_SIZE)
+    PANIC("free_pages: bad range %x (%d pages)", paddr, n);
+
+  buddy_free_range(paddr, n);
+}
+
+// one more page table maps this page
+void page_ref(paddr_t paddr) { paddr_to_page(paddr)->refs++; }
+
+// drop a reference taken by alloc_pages or page_ref, the last one frees it
+void page_unref(paddr_t paddr) {
+  struct page *page = paddr_to_page(paddr);
+  if (page->refs == 0)
+    PANIC("page_unref: page %x is not referenced", paddr);
+  if (--page->refs == 0)
+    free_pages(paddr, 1);
+}
+
+uint32_t page_refs(paddr_t paddr) { return paddr_to_page(paddr)->refs; }
+
+// fill in the allocator counters
+void page_stats(struct page_stats *stats) {
+  stats->total = ram_pages;
+  stats->free = ram_free_pages;
+  stats->used = ram_pages - ram_free_pages;
+  stats->fragmented = 0;
+  for (uint32_t order = 0; order < BUDDY_FRAG_ORDER; order++)
+    stats->fragmented += free_counts[order] << order;
+  stats->zeroed = zero_pool_count;
+  stats->zero_hits = zero_pool_hits;
+  stats->zero_misses = zero_pool_misses;
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        page tables │
+//                                      ────────────────────────────────────────┘
+
+// kernel half of every address space, built once by kernel_page_table_init
+uint32_t *kernel_page_table;
+
+// map pages using riscv's Sv32's page table
+// vpn: virtual page number
+// pfn: physical frame number
+// pages are virtual, frames are physical
+// Sv32 uses two-level page table
+void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+  if (!is_aligned(vaddr, PAGE_SIZE))
+    PANIC("unaligned vaddr %x", vaddr);
+
+  if (!is_aligned(paddr, PAGE_SIZE))
+    PANIC("unaligned paddr %x", paddr);
+
+  uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+  if ((table1[vpn1] & PAGE_V) == 0) {
+    uint32_t pt_paddr = alloc_pages(1);
+    table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V;
+  }
+  if (table1[vpn1] & (PAGE_R | PAGE_W | PAGE_X))
+    PANIC("map_page: vaddr %x is inside a megapage", vaddr);
+
+  uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
+  uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
+  table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+// map a 4MB megapage directly in the root table (no second-level table)
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr,
+                  uint32_t flags) {
+  if (!is_aligned(vaddr, MEGAPAGE_SIZE))
+    PANIC("unaligned megapage vaddr %x", vaddr);
+
+  if (!is_aligned(paddr, MEGAPAGE_SIZE))
+    PANIC("unaligned megapage paddr %x", paddr);
+
+  uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+  table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+// identity map the kernel, free ram and the MMIO regions once at boot.
+// 4MB-aligned stretches use megapages, the unaligned head and tail fall back
+// to 4KB pages. every process root table links to these same entries, so all
+// kernel mappings must be in place before the first create_process. they are
+// global, so their TLB entries survive switching between ASIDs.
+void kernel_page_table_init(void) {
+  kernel_page_table = (uint32_t *)alloc_pages(1);
+  uint32_t rwx = PAGE_R | PAGE_W | PAGE_X | PAGE_G;
+  uint32_t rw = PAGE_R | PAGE_W | PAGE_G;
+
+  paddr_t paddr = (paddr_t)__kernel_base;
+  paddr_t end = (paddr_t)__free_ram_end;
+  while (paddr < end) {
+    if (is_aligned(paddr, MEGAPAGE_SIZE) && end - paddr >= MEGAPAGE_SIZE) {
+      map_megapage(kernel_page_table, paddr, paddr, rwx);
+      paddr += MEGAPAGE_SIZE;
+    } else {
+      map_page(kernel_page_table, paddr, paddr, rwx);
+      paddr += PAGE_SIZE;
+    }
+  }
+
+  // map the MMIO
+  map_page(kernel_page_table, UART_PADDR, UART_PADDR, rw);
+  map_page(kernel_page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, rw);
+  map_megapage(kernel_page_table, PLIC_PADDR, PLIC_PADDR, rw);
+}
+
+// new root table for a process, sharing all kernel entries
+uint32_t *alloc_page_table(void) {
+  uint32_t *table1 = (uint32_t *)alloc_pages(1);
+  memcpy(table1, kernel_page_table, PAGE_SIZE);
+  return table1;
+}
+
+// tear down a process page table: every user page, every second-level table
+// and the root table itself go back to the allocator. entries shared with
+// kernel_page_table are left alone.
+void free_page_table(uint32_t *table1) {
+  for (uint32_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+    if ((table1[vpn1] & PAGE_V) == 0 ||
+        table1[vpn1] == kernel_page_table[vpn1])
+      continue;
+
+    uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
+    for (uint32_t vpn0 = 0; vpn0 < 1024; vpn0++) {
+      uint32_t pte = table0[vpn0];
+      if ((pte & PAGE_V) && (pte & PAGE_U) && !(pte & PAGE_SHARED))
+        page_unref((pte >> 10) * PAGE_SIZE);
+    }
+
+    free_pages((paddr_t)table0, 1);
+  }
+
+  free_pages((paddr_t)table1, 1);
+}
+
+// the level-0 entry for vaddr, or NULL if its second-level table is missing
+// or vaddr lies in a megapage (a leaf entry at the top level)
+uint32_t *walk_pte(uint32_t *table1, vaddr_t vaddr) {
+  uint32_t pte1 = table1[(vaddr >> 22) & 0x3ff];
+  if ((pte1 & PAGE_V) == 0 || (pte1 & (PAGE_R | PAGE_W | PAGE_X)))
+    return NULL;
+
+  uint32_t *table0 = (uint32_t *)((pte1 >> 10) * PAGE_SIZE);
+  return &table0[(vaddr >> 12) & 0x3ff];
+}
+
+// checks that [vaddr, vaddr+len) lies in user space and is mapped for user
+// mode with at least the permissions in `need` (PAGE_R, PAGE_W, ...)
+bool user_range_ok(uint32_t *table1, vaddr_t vaddr, size_t len,
+                   uint32_t need) {
+  if (vaddr < USER_BASE || vaddr + len < vaddr || vaddr + len > USER_TOP)
+    return false;
+
+  vaddr_t end = vaddr + len;
+  for (vaddr_t va = vaddr & ~(PAGE_SIZE - 1); va < end; va += PAGE_SIZE) {
+    uint32_t *pte = walk_pte(table1, va);
+    uint32_t flags = PAGE_V | PAGE_U | need;
+    if (!pte || (*pte & flags) != flags)
+      return false;
+  }
+  return true;
+}
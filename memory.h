@@ -0,0 +1,67 @@
+// ░█▄█░█▀▀░█▄█░█▀█░█▀▄░█░█░░░█░█
+// ░█░█░█▀▀░█░█░█░█░█▀▄░░█░░░░█▀█
+// ░▀░▀░▀▀▀░▀░▀░▀▀▀░▀░▀░░▀░░▀░▀░▀
+// memory.h
+// physical page allocator and page tables
+
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#include "common.h"
+
+/*---------------- buddy allocator ------------------------------------------*/
+
+#define BUDDY_MAX_ORDER 10 // largest block is 2^10 pages (4MB)
+#define BUDDY_FRAG_ORDER 2 // free blocks below this order count as fragmented
+
+#define ZERO_POOL_MAX 64 // pre-zeroed single pages kept by the idle loop
+
+#define PG_FREE (1 << 0) // page heads a block sitting on a free list
+
+// one of these per physical page managed by the buddy allocator
+struct page {
+  struct page *next; // free list links, only valid while PG_FREE is set
+  struct page *prev;
+  uint8_t order; // order of the block this page heads
+  uint8_t flags; // PG_*
+  uint16_t refs; // page tables (and caches) holding an allocated page
+};
+
+// snapshot of the allocator counters (all in pages)
+struct page_stats {
+  uint32_t total;      // pages managed by the allocator
+  uint32_t free;       // pages sitting on a free list
+  uint32_t used;       // pages handed out by alloc_pages
+  uint32_t fragmented; // free pages in blocks smaller than BUDDY_FRAG_ORDER
+  uint32_t zeroed;      // pre-zeroed pages waiting in the pool (counted as used)
+  uint32_t zero_hits;   // single-page allocations served from the pool
+  uint32_t zero_misses; // single-page allocations zeroed on the spot
+};
+
+/*---------------- page tables ----------------------------------------------*/
+
+#define MEGAPAGE_SIZE (4 * 1024 * 1024) // Sv32 leaf entry in the root table
+#define USER_BASE 0x1000000
+#define USER_TOP 0x80000000 // user space ends below the kernel
+
+extern char __kernel_base[];
+extern uint32_t *kernel_page_table; // shared kernel mappings
+extern void (*page_reclaim_hook)(void); // frees cached memory on demand
+
+// functions
+
+void page_alloc_init(void);
+void free_pages(paddr_t paddr, uint32_t n);
+void page_ref(paddr_t paddr);
+void page_unref(paddr_t paddr);
+uint32_t page_refs(paddr_t paddr);
+void zero_pool_refill(void);
+void page_stats(struct page_stats *stats);
+void kernel_page_table_init(void);
+uint32_t *alloc_page_table(void);
+void free_page_table(uint32_t *table1);
+uint32_t *walk_pte(uint32_t *table1, vaddr_t vaddr);
+bool user_range_ok(uint32_t *table1, vaddr_t vaddr, size_t len,
+                   uint32_t need);
+
+#endif // MEMORY_H_
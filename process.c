@@ -3,11 +3,12 @@
 // ░▀░░░▀░▀░▀▀▀░▀▀▀░▀▀▀░▀▀▀░▀▀▀░▀░░▀▀▀
 
 #include "process.h"
+#include "elf.h"
+#include "memory.h"
 
 struct process procs[PROCS_MAX]; //
-extern char __kernel_base[];
 
-extern char _binary_shell_bin_start[], _binary_shell_bin_size[];
+extern char _binary_shell_exe_start[], _binary_shell_exe_size[];
 
 __attribute__((naked)) void switch_context(uint32_t *prev_sp /* a0  */,
                                            uint32_t *next_sp /* a1 */) {
@@ -56,18 +57,277 @@ __attribute__((naked)) void switch_context(uint32_t *prev_sp /* a0  */,
 // user_entry
 // ↓ __attribute__((naked)) is very important!
 __attribute__((naked)) void user_entry(void) {
-  // 1. set program counter in the sepc
-  // 2. set the SPIE bit in sstatus to enable hw interrupts when in u-mode
-  // 3. u-mode with sret
-  __asm__ __volatile__("csrw sepc, %[sepc]        \n"
-                       "csrw sstatus, %[sstatus]  \n"
-                       "sret                      \n"
+  // 1. we came here through yield, so drop the kernel lock
+  // 2. set program counter in the sepc, main's argument in a0
+  // 3. set the SPIE bit in sstatus to enable hw interrupts when in u-mode
+  //    (and nothing else: VS stays off in u-mode)
+  // 4. u-mode with sret
+  // the entry point of the image comes in s0 and the argument in s1, see
+  // alloc_process and spawn_process
+  __asm__ __volatile__("call unlock_kernel      \n"
+                       "csrw sepc, s0           \n"
+                       "mv a0, s1               \n"
+                       "li t0, %[sstatus]       \n"
+                       "csrw sstatus, t0        \n"
+                       "sret                    \n"
                        :
-                       : [sepc] "r"(USER_BASE), [sstatus] "r"(SSTATUS_SPIE));
+                       : [sstatus] "i"(SSTATUS_SPIE));
 }
 
-// create_process
-struct process *create_process(const void *image, size_t image_size) {
+// the trap entries load tp from the word right above the kernel stack
+_Static_assert(offsetof(struct process, cpu) ==
+                   offsetof(struct process, stack) + sizeof(procs[0].stack),
+               "struct process: cpu must follow the kernel stack");
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        harts and locks │
+//                                      ────────────────────────────────────────┘
+
+struct cpu cpus[HARTS_MAX];
+uint32_t ncpus;
+
+// all of the kernel (process table, scheduler, file system, buffer cache,
+// allocator, devices) runs under this one lock. a hart takes it when it
+// traps in from user mode and drops it on the way back out, or while its
+// idle thread waits for an interrupt. user code runs on every hart at once.
+struct spinlock kernel_lock;
+
+void spin_lock(struct spinlock *lock) {
+  struct cpu *cpu = this_cpu();
+  if (lock->owner == cpu)
+    PANIC("spin_lock: hart %d already holds the lock", cpu->hartid);
+
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+      ;
+  }
+  lock->owner = cpu;
+}
+
+void spin_unlock(struct spinlock *lock) {
+  if (lock->owner != this_cpu())
+    PANIC("spin_unlock: lock not held by hart %d", this_cpu()->hartid);
+
+  lock->owner = NULL;
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+void lock_kernel(void) { spin_lock(&kernel_lock); }
+void unlock_kernel(void) { spin_unlock(&kernel_lock); }
+
+// claim the next struct cpu for `hartid` and point tp at it
+struct cpu *cpu_init(uint32_t hartid) {
+  if (ncpus == HARTS_MAX)
+    PANIC("too many harts");
+
+  struct cpu *cpu = &cpus[ncpus++];
+  cpu->hartid = hartid;
+  __asm__ __volatile__("mv tp, %0" ::"r"(cpu));
+  return cpu;
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        run queues │
+//                                      ────────────────────────────────────────┘
+
+// one FIFO per priority level plus a bitmap of the non-empty levels, so
+// picking the next process is a count-trailing-zeros away. every hart has
+// its own set, holding the processes that last ran there. runnable
+// processes sit on a queue except for the ones currently running.
+
+// append a runnable process to the queue of its current priority
+void runq_push(struct cpu *cpu, struct process *proc) {
+  int prio = proc->priority;
+  proc->run_next = NULL;
+  if (cpu->runq_tail[prio])
+    cpu->runq_tail[prio]->run_next = proc;
+  else
+    cpu->runq_head[prio] = proc;
+  cpu->runq_tail[prio] = proc;
+  cpu->runq_bitmap |= 1u << prio;
+  cpu->runq_count++;
+}
+
+// take the first process of the best non-empty level, NULL if all are empty
+struct process *runq_pop(struct cpu *cpu) {
+  if (!cpu->runq_bitmap)
+    return NULL;
+
+  int prio = __builtin_ctz(cpu->runq_bitmap);
+  struct process *proc = cpu->runq_head[prio];
+  cpu->runq_head[prio] = proc->run_next;
+  if (!cpu->runq_head[prio]) {
+    cpu->runq_tail[prio] = NULL;
+    cpu->runq_bitmap &= ~(1u << prio);
+  }
+  cpu->runq_count--;
+  return proc;
+}
+
+// our queues are empty: take the best process waiting on the hart with the
+// longest queue, NULL if nobody has any to spare
+struct process *runq_steal(struct cpu *cpu) {
+  struct cpu *victim = NULL;
+  for (uint32_t i = 0; i < ncpus; i++) {
+    if (&cpus[i] != cpu && cpus[i].runq_count > 0 &&
+        (!victim || cpus[i].runq_count > victim->runq_count))
+      victim = &cpus[i];
+  }
+  return victim ? runq_pop(victim) : NULL;
+}
+
+// have `cpu` look at its run queues again, now if it is another hart
+void cpu_resched(struct cpu *cpu) {
+  cpu->resched = true;
+  if (cpu != this_cpu())
+    sbi_send_ipi(cpu->hartid);
+}
+
+// make a process runnable and queue it on the hart it last ran on. one that
+// was sleeping gets a temporary priority boost, which it keeps until it burns
+// a whole time slice, so interactive processes get back on the cpu ahead of
+// batch work. if that hart is busy with something at least as good, an idle
+// hart is poked to come and steal it.
+void make_runnable(struct process *proc, bool woken) {
+  proc->state = PROC_RUNNABLE;
+  if (woken) {
+    proc->priority = proc->base_priority > PRIO_WAKE_BOOST
+                         ? proc->base_priority - PRIO_WAKE_BOOST
+                         : 0;
+  }
+  struct cpu *cpu = proc->cpu ? proc->cpu : this_cpu();
+  runq_push(cpu, proc);
+
+  if (cpu->proc == cpu->idle || proc->priority < cpu->proc->priority) {
+    cpu_resched(cpu);
+    return;
+  }
+  for (uint32_t i = 0; i < ncpus; i++) {
+    if (cpus[i].proc == cpus[i].idle) {
+      cpu_resched(&cpus[i]);
+      return;
+    }
+  }
+}
+
+// change the base priority of a process by `inc` (like nice(2))
+// returns the new base priority
+int proc_nice(struct process *proc, int inc) {
+  int prio = proc->base_priority + inc;
+  if (prio < 0)
+    prio = 0;
+  if (prio > PRIO_LEVELS - 1)
+    prio = PRIO_LEVELS - 1;
+  proc->base_priority = prio;
+  proc->priority = prio;
+  return prio;
+}
+
+// one physical copy of each program segment, shared by every process
+// started from the same image. pages are copied in from the kernel's copy
+// of the ELF file when some process first touches them. the cache keeps a
+// reference to each page, so the copy survives while no process runs the
+// program.
+struct image images[IMAGES_MAX];
+
+// the cache entry for the segment described by `phdr`
+struct image *image_lookup(const void *image, struct elf_phdr *phdr) {
+  struct image *img = NULL;
+  for (int i = 0; i < IMAGES_MAX; i++) {
+    if (images[i].data == image && images[i].vaddr == phdr->vaddr)
+      return &images[i];
+    if (!img && !images[i].data)
+      img = &images[i];
+  }
+  if (!img)
+    PANIC("too many program segments");
+
+  vaddr_t start = phdr->vaddr & ~(PAGE_SIZE - 1);
+  uint32_t npages = (align_up(phdr->vaddr + phdr->memsz, PAGE_SIZE) - start) /
+                    PAGE_SIZE;
+  img->pages = (paddr_t *)alloc_pages(
+      align_up(npages * sizeof(paddr_t), PAGE_SIZE) / PAGE_SIZE);
+  img->data = image;
+  img->offset = phdr->offset;
+  img->vaddr = phdr->vaddr;
+  img->filesz = phdr->filesz;
+  return img;
+}
+
+// the shared page for page `index` of a segment, or 0 if that page holds
+// no bytes from the file (bss, stack) and is simply zero. *major tells
+// whether the page had to be copied in just now.
+paddr_t image_get_page(struct image *img, uint32_t index, bool *major) {
+  vaddr_t va = (img->vaddr & ~(PAGE_SIZE - 1)) + index * PAGE_SIZE;
+  vaddr_t file_end = img->vaddr + img->filesz;
+  *major = false;
+  if (va >= file_end)
+    return 0;
+
+  if (!img->pages[index]) {
+    vaddr_t from = va > img->vaddr ? va : img->vaddr;
+    vaddr_t to = va + PAGE_SIZE < file_end ? va + PAGE_SIZE : file_end;
+    paddr_t page = alloc_pages(1);
+    memcpy((void *)(page + from - va),
+           (const uint8_t *)img->data + img->offset + (from - img->vaddr),
+           to - from);
+    img->pages[index] = page;
+    *major = true;
+  }
+  return img->pages[index];
+}
+
+// turns each PT_LOAD segment of an ELF image into a region of `proc`, with
+// the segment's own permissions. nothing is mapped yet, handle_page_fault
+// brings pages in on first touch. returns the entry point.
+vaddr_t elf_load(struct process *proc, const void *image, size_t image_size) {
+  struct elf_header ehdr;
+  if (image_size < sizeof(ehdr))
+    PANIC("program image too small");
+
+  // the embedded image need not be aligned, so copy headers out first
+  memcpy(&ehdr, image, sizeof(ehdr));
+  if (ehdr.magic != ELF_MAGIC || ehdr.class != ELFCLASS32 ||
+      ehdr.type != ET_EXEC || ehdr.machine != EM_RISCV)
+    PANIC("not a riscv32 ELF executable");
+
+  int nvmas = 0;
+  for (int i = 0; i < ehdr.phnum; i++) {
+    struct elf_phdr phdr;
+    uint32_t off = ehdr.phoff + i * ehdr.phentsize;
+    if (off + sizeof(phdr) > image_size)
+      PANIC("program header %d is past the end of the image", i);
+
+    memcpy(&phdr, (const uint8_t *)image + off, sizeof(phdr));
+    if (phdr.type != PT_LOAD || phdr.memsz == 0)
+      continue;
+    if (phdr.offset + phdr.filesz > image_size || phdr.filesz > phdr.memsz ||
+        phdr.vaddr < USER_BASE || phdr.vaddr + phdr.memsz > MMAP_BASE)
+      PANIC("bad PT_LOAD segment at %x", phdr.vaddr);
+    if (nvmas == VMA_MAX)
+      PANIC("too many PT_LOAD segments");
+
+    struct vma *vma = &proc->vmas[nvmas++];
+    vma->start = phdr.vaddr & ~(PAGE_SIZE - 1);
+    vma->end = align_up(phdr.vaddr + phdr.memsz, PAGE_SIZE);
+    vma->type = VMA_IMAGE;
+    vma->prot = ((phdr.flags & PF_R) ? PROT_READ : 0) |
+                ((phdr.flags & PF_W) ? PROT_WRITE : 0) |
+                ((phdr.flags & PF_X) ? PROT_EXEC : 0);
+    vma->image = image_lookup(image, &phdr);
+  }
+  return ehdr.entry;
+}
+
+// a process slot with a fresh kernel stack that starts at `entry` on its
+// first switch_context. no address space yet. NULL if all slots are taken.
+struct process *alloc_proc_slot(void (*entry)(void)) {
   // find an unused process control structure.
   struct process *proc = NULL;
   int i;
@@ -80,82 +340,340 @@ struct process *create_process(const void *image, size_t image_size) {
   }
 
   if (!proc)
-    PANIC("no free process slots");
+    return NULL;
 
   // stack callee-saved registers. These register values will be restored in
   // the first context switch in switch_context.
   uint32_t *sp = (uint32_t *)&proc->stack[sizeof(proc->stack)];
-  *--sp = 0;                    // s11
-  *--sp = 0;                    // s10
-  *--sp = 0;                    // s9
-  *--sp = 0;                    // s8
-  *--sp = 0;                    // s7
-  *--sp = 0;                    // s6
-  *--sp = 0;                    // s5
-  *--sp = 0;                    // s4
-  *--sp = 0;                    // s3
-  *--sp = 0;                    // s2
-  *--sp = 0;                    // s1
-  *--sp = 0;                    // s0
-  *--sp = (uint32_t)user_entry; // ra
-
-  // map kernel pages
-  uint32_t *page_table = (uint32_t *)alloc_pages(1);
-  for (paddr_t paddr = (paddr_t)__kernel_base; paddr < (paddr_t)__free_ram_end;
-       paddr += PAGE_SIZE)
-    map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-
-  // map the MMIO
-  map_page(page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W);
-
-  // map user pages
-  for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-    paddr_t page = alloc_pages(1);
-
-    size_t remaining = image_size - off;
-    size_t copy_size = PAGE_SIZE <= remaining ? PAGE_SIZE : remaining;
-
-    memcpy((void *)page, image + off, copy_size);
-    map_page(page_table, USER_BASE + off, page,
-             PAGE_U | PAGE_R | PAGE_W | PAGE_X);
-  }
+  *--sp = 0;               // s11
+  *--sp = 0;               // s10
+  *--sp = 0;               // s9
+  *--sp = 0;               // s8
+  *--sp = 0;               // s7
+  *--sp = 0;               // s6
+  *--sp = 0;               // s5
+  *--sp = 0;               // s4
+  *--sp = 0;               // s3
+  *--sp = 0;               // s2
+  *--sp = 0;               // s1
+  *--sp = 0;               // s0
+  *--sp = (uint32_t)entry; // ra
 
   proc->pid = i + 1;
-  proc->state = PROC_RUNNABLE;
   proc->sp = (uint32_t)sp;
-  proc->page_table = page_table;
+  proc->page_table = NULL;
+  proc->asid = 0; // generation 0 is never current, see proc_asid
+  proc->base_priority = PRIO_DEFAULT;
+  proc->priority = PRIO_DEFAULT;
+  memset(proc->vmas, 0, sizeof(proc->vmas));
+  proc->mmap_next = MMAP_BASE;
+  proc->major_faults = 0;
+  proc->minor_faults = 0;
+  proc->parent = NULL;
+  proc->image = NULL;
+  proc->image_size = 0;
+  proc->cpu = NULL; // queued on the creating hart, see make_runnable
+  return proc;
+}
+
+// set up a process slot, its kernel stack and address space. the caller
+// decides whether it goes on a run queue. NULL if all slots are taken.
+struct process *alloc_process(const void *image, size_t image_size) {
+  struct process *proc = alloc_proc_slot(user_entry);
+  if (!proc)
+    return NULL;
+
+  // link the shared kernel mappings
+  proc->page_table = alloc_page_table();
+  proc->image = image;
+  proc->image_size = image_size;
+
+  // user_entry finds the entry point in s0
+  uint32_t *sp = (uint32_t *)proc->sp;
+  sp[1] = elf_load(proc, image, image_size);
   return proc;
 } // switch_context
 
-struct process *current_proc; // current process
-struct process *idle_proc;    // idle process
+// create_process, NULL if all slots are taken
+struct process *create_process(const void *image, size_t image_size) {
+  struct process *proc = alloc_process(image, image_size);
+  if (proc)
+    make_runnable(proc, false);
+  return proc;
+}
 
-// voluntarily give up control and have next process run
-// (we don't have a very sophisticated scheduler yet)
-void yield(void) {
-  struct process *next = idle_proc;
+// a child of the current process running the same program from its entry
+// point, with `arg` as the argument to main. NULL if all slots are taken.
+struct process *spawn_process(int arg) {
+  struct process *parent = current_proc;
+  struct process *proc = alloc_process(parent->image, parent->image_size);
+  if (!proc)
+    return NULL;
+
+  // user_entry hands s1 to main in a0
+  ((uint32_t *)proc->sp)[2] = arg;
+  proc->parent = parent;
+  make_runnable(proc, false);
+  return proc;
+}
+
+// the current process or kernel thread is done. its children lose their
+// parent, a parent waiting in wait_children is woken up, and the slot is
+// reclaimed once we have switched away.
+void proc_exit(void) {
+  struct process *proc = current_proc;
   for (int i = 0; i < PROCS_MAX; i++) {
-    struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-    if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-      next = proc;
-      break;
+    if (procs[i].parent == proc)
+      procs[i].parent = NULL;
+  }
+  if (proc->parent)
+    wakeup(proc->parent);
+
+  proc->state = PROC_EXITED;
+  yield();
+  PANIC("unreachable");
+}
+
+// block until every child of the current process has exited
+void wait_children(void) {
+  for (;;) {
+    bool waiting = false;
+    for (int i = 0; i < PROCS_MAX; i++) {
+      if (procs[i].parent == current_proc &&
+          procs[i].state != PROC_UNUSED && procs[i].state != PROC_EXITED)
+        waiting = true;
+    }
+    if (!waiting)
+      return;
+    sleep_on(current_proc);
+  }
+}
+
+// first switch into a kernel thread: call fn(arg), both left in s0/s1 by
+// create_kernel_thread, and exit when it returns
+__attribute__((naked)) void kernel_thread_entry(void) {
+  __asm__ __volatile__("mv a0, s1\n"
+                       "jalr s0\n"
+                       "j proc_exit\n");
+}
+
+// a thread that runs `fn(arg)` in the kernel. it has no user address space,
+// so switching to it leaves satp alone: the kernel mappings are global and
+// linked into every page table. the kernel runs with interrupts off, so a
+// thread keeps the hart until it yields, sleeps or returns.
+struct process *create_kernel_thread(void (*fn)(void *), void *arg) {
+  struct process *proc = alloc_proc_slot(kernel_thread_entry);
+  if (!proc)
+    PANIC("no free process slots");
+
+  uint32_t *sp = (uint32_t *)proc->sp;
+  sp[1] = (uint32_t)fn;  // s0
+  sp[2] = (uint32_t)arg; // s1
+  make_runnable(proc, false);
+  return proc;
+}
+
+// the idle process of this hart is its boot context, running the idle loop
+// whenever every run queue is empty, so it never sits on one itself. it is a
+// kernel thread that is already running, its slot's stack frame is unused.
+struct process *create_idle_process(void) {
+  struct process *proc = alloc_proc_slot(kernel_thread_entry);
+  if (!proc)
+    PANIC("no free process slots");
+
+  struct cpu *cpu = this_cpu();
+  proc->pid = 0; // idle
+  proc->state = PROC_RUNNABLE;
+  proc->priority = PRIO_LEVELS;
+  proc->cpu = cpu;
+  cpu->idle = proc;
+  cpu->proc = proc;
+  return proc;
+}
+
+// ┌────────────────────────────────────────────────────────────────────────────
+// │
+// │
+//
+//        address space IDs │
+//                                      ────────────────────────────────────────┘
+
+// every process gets an ASID tagged with the generation it was handed out in.
+// when the ASIDs run out the generation moves on and the whole TLB is flushed
+// once, on every hart; processes still holding an old generation take a
+// fresh ASID the next time they run. so a switch is a plain satp write, and a
+// process's stale translations can only be hit again after that flush.
+uint32_t asid_bits;
+uint32_t asid_generation; // counts in units of 1 << asid_bits
+uint32_t asid_next;       // next free ASID in this generation, 0 is the kernel's
+
+// find out how many ASID bits satp keeps by writing all ones, which needs
+// paging on. the kernel table maps the kernel so this is harmless. all
+// harts are assumed to be the same.
+void asid_init(void) {
+  uint32_t probe = SATP_SV32 | (SATP_ASID_MASK << SATP_ASID_SHIFT) |
+                   ((uint32_t)kernel_page_table / PAGE_SIZE);
+  uint32_t satp;
+  __asm__ __volatile__("csrw satp, %[probe]\n"
+                       "csrr %[satp], satp\n"
+                       "csrw satp, zero\n"
+                       "sfence.vma\n"
+                       : [satp] "=r"(satp)
+                       : [probe] "r"(probe));
+  uint32_t asids = (satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  while (asids & (1u << asid_bits))
+    asid_bits++;
+
+  asid_generation = 1u << asid_bits;
+  asid_next = 1;
+  printf("asid: %d bits\n", asid_bits);
+}
+
+// the ASID `proc` runs with, handing out a new one if its generation is gone.
+// the other harts flush their TLBs before their next switch.
+uint32_t proc_asid(struct process *proc) {
+  if (asid_bits == 0)
+    return 0;
+
+  uint32_t mask = (1u << asid_bits) - 1;
+  if ((proc->asid & ~mask) != asid_generation) {
+    if (asid_next > mask) {
+      asid_generation += mask + 1;
+      if (asid_generation == 0) // wrapped, keep 0 meaning "no ASID yet"
+        asid_generation = mask + 1;
+      asid_next = 1;
+      for (uint32_t i = 0; i < ncpus; i++)
+        cpus[i].tlb_stale = true;
     }
+    proc->asid = asid_generation | asid_next++;
   }
+  return proc->asid & mask;
+}
+
+// point satp at another table. without ASIDs the TLB has to go each time.
+void load_satp(struct cpu *cpu, uint32_t satp) {
+  if (cpu->tlb_stale) {
+    __asm__ __volatile__("sfence.vma" ::: "memory");
+    cpu->tlb_stale = false;
+  }
+  if (satp == cpu->loaded_satp)
+    return;
+
+  if (asid_bits == 0)
+    __asm__ __volatile__("sfence.vma" ::: "memory");
+  __asm__ __volatile__("csrw satp, %0" ::"r"(satp) : "memory");
+  if (asid_bits == 0)
+    __asm__ __volatile__("sfence.vma" ::: "memory");
+  cpu->loaded_satp = satp;
+}
+
+// an idle thread about to wait with the kernel lock dropped moves off any
+// process page table it borrowed, which could be freed in the meantime
+void drop_borrowed_page_table(void) {
+  struct cpu *cpu = this_cpu();
+  if (cpu->loaded_satp && cpu->proc && !cpu->proc->page_table)
+    load_satp(cpu, SATP_SV32 | ((uint32_t)kernel_page_table / PAGE_SIZE));
+}
+
+// give up control and have the best runnable process run. the current
+// process goes to the back of its queue if it is still runnable, and a hart
+// with nothing queued steals from the others. constant time no matter how
+// many process slots there are.
+void yield(void) {
+  struct cpu *cpu = this_cpu();
+  cpu->resched = false;
+  if (cpu->proc != cpu->idle && cpu->proc->state == PROC_RUNNABLE)
+    runq_push(cpu, cpu->proc);
 
-  if (next == current_proc)
+  struct process *next = runq_pop(cpu);
+  if (!next)
+    next = runq_steal(cpu);
+  if (!next)
+    next = cpu->idle;
+
+  if (next == cpu->proc)
     return;
 
-  struct process *prev = current_proc;
-  current_proc = next;
+  struct process *prev = cpu->proc;
+  cpu->proc = next;
+
+  // a kernel thread borrows whatever page table is loaded, unless that one
+  // belongs to a process that just exited. with ASIDs the TLB keeps every
+  // process's translations apart and the global kernel ones stay put.
+  uint32_t satp = cpu->loaded_satp;
+  uint32_t asid = 0;
+  if (next->page_table) {
+    asid = proc_asid(next);
+    satp = SATP_SV32 | (asid << SATP_ASID_SHIFT) |
+           ((uint32_t)next->page_table / PAGE_SIZE);
+  } else if (prev->state == PROC_EXITED && prev->page_table) {
+    satp = SATP_SV32 | ((uint32_t)kernel_page_table / PAGE_SIZE);
+  }
+  load_satp(cpu, satp);
 
+  // coming from another hart, the process may have changed its mappings
+  // there since this hart last cached any of them
+  if (next->page_table && next->cpu != cpu && asid_bits)
+    __asm__ __volatile__("sfence.vma zero, %0" ::"r"(asid) : "memory");
+  next->cpu = cpu;
   __asm__ __volatile__(
-      "sfence.vma\n"
-      "csrw satp, %[satp]\n"
-      "sfence.vma\n"
-      "csrw sscratch, %[sscratch]\n"
-      :
-      : [satp] "r"(SATP_SV32 | ((uint32_t)next->page_table / PAGE_SIZE)),
-        [sscratch] "r"((uint32_t)&next->stack[sizeof(next->stack)]));
+      "csrw sscratch, %0" ::"r"((uint32_t)&next->stack[sizeof(next->stack)]));
+
+  // an exited process is no longer reachable through satp, so its address
+  // space can go back to the page allocator. its ASID is not handed out again
+  // before the next rollover flush, so stale entries for it are harmless. the
+  // kernel stack lives in procs[] and is only reused once the slot is handed
+  // out again, and the kernel lock keeps other harts away until we are off it.
+  if (prev->state == PROC_EXITED) {
+    if (prev->page_table)
+      free_page_table(prev->page_table);
+    prev->page_table = NULL;
+    prev->state = PROC_UNUSED;
+  }
 
   switch_context(&prev->sp, &next->sp);
 }
+
+// the current process used up its time slice: it loses any wake-up boost
+// and goes to the back of its queue
+void preempt(void) {
+  current_proc->priority = current_proc->base_priority;
+  yield();
+}
+
+// sleeping processes hang off a small hash of their wait channel, so wakeup
+// only looks at processes that could be waiting on `chan`
+struct process *sleep_hash[SLEEP_HASH_SIZE];
+
+struct process **sleep_bucket(void *chan) {
+  return &sleep_hash[((uint32_t)chan >> 4) % SLEEP_HASH_SIZE];
+}
+
+// block the current process until someone calls wakeup(chan). the kernel
+// does not take interrupts and other harts wait for the kernel lock, so
+// nothing can call wakeup between the caller checking its condition and us
+// going to sleep.
+void sleep_on(void *chan) {
+  struct process **bucket = sleep_bucket(chan);
+  current_proc->wait_chan = chan;
+  current_proc->wait_next = *bucket;
+  *bucket = current_proc;
+  current_proc->state = PROC_BLOCKED;
+  yield();
+  current_proc->wait_chan = NULL;
+}
+
+// make every process sleeping on `chan` runnable again
+void wakeup(void *chan) {
+  struct process **link = sleep_bucket(chan);
+  while (*link) {
+    struct process *proc = *link;
+    if (proc->wait_chan != chan) {
+      link = &proc->wait_next;
+      continue;
+    }
+
+    *link = proc->wait_next;
+    make_runnable(proc, true);
+  }
+}
@@ -13,33 +13,141 @@
 
 /*---------------- process ------------------------------------------------*/
 
-#define PROCS_MAX 8 // maximum number of processes
+#define PROCS_MAX 16 // maximum number of processes, idle threads included
 
 #define PROC_UNUSED 0   // unused process control structure
 #define PROC_RUNNABLE 1 // runnable process
+#define PROC_EXITED 2   // exited, address space is reclaimed on switch-out
+#define PROC_BLOCKED 3  // sleeping in sleep_on until wakeup
+
+#define PRIO_LEVELS 32    // run queue levels, 0 is the best priority
+#define PRIO_DEFAULT 16   // base priority of a new process
+#define PRIO_WAKE_BOOST 4 // levels gained by a process that slept
+#define SLEEP_HASH_SIZE 16
+
+#define VMA_MAX 8           // mmap regions per process
+#define MMAP_BASE 0x2000000 // mmap hands out addresses from here up
+#define MMAP_TOP PLIC_PADDR // ...to here, below the MMIO and kernel megapages
+
+#define VMA_FILE 1  // a file mapped with mmap
+#define VMA_IMAGE 2 // a loadable segment of the program image
+
+// a region of a process's address space, pages are filled in by page faults
+struct vma {
+  vaddr_t start; // page aligned, 0 if the slot is free
+  vaddr_t end;
+  int type;      // VMA_*
+  int prot;      // PROT_READ, PROT_WRITE, PROT_EXEC
+  int file;      // VMA_FILE: index into the file table
+  struct image *image; // VMA_IMAGE: the shared image pages
+};
+
+#define IMAGES_MAX 8 // program segments kept in memory
+
+// a loadable segment of a program image, shared between processes
+struct image {
+  const void *data; // the ELF image in the kernel, identifies it with vaddr
+  uint32_t offset;  // where the segment's bytes start in the ELF file
+  vaddr_t vaddr;    // where they go in memory
+  uint32_t filesz;  // bytes from the file, the rest of the segment is zero
+  paddr_t *pages;   // one shared physical page per segment page, 0 until used
+};
 
 #define USER_BASE 0x1000000
 struct process {
   int pid;    // process ID
-  int state;  // process state: PROC_UNUSED or PROC_RUNNABLE
+  int state;  // process state: PROC_UNUSED, PROC_RUNNABLE, ...
               // __attribute__((naked)) void switch_context(uint32_t *prev_sp /*
               // a0  */,
   vaddr_t sp; // stack pointer
-  uint32_t *page_table; // page table
+  uint32_t *page_table; // page table, NULL for kernel threads
+  uint32_t asid;        // ASID in the low asid_bits, its generation above
+  int base_priority;    // set with nice, 0..PRIO_LEVELS-1
+  int priority;         // base_priority minus any wake-up boost
+  struct process *run_next;  // next process on the same run queue
+  void *wait_chan;           // what a PROC_BLOCKED process is waiting for
+  struct process *wait_next; // next process in the same sleep_hash bucket
+  struct vma vmas[VMA_MAX];  // mmap regions
+  vaddr_t mmap_next;         // where the next mmap region goes
+  uint32_t major_faults;     // faults that had to produce the page's contents
+  uint32_t minor_faults;     // faults that only had to map or copy a page
+  struct process *parent;    // who spawned us and may wait for us, or NULL
+  const void *image;         // the ELF image we run, for spawn
+  size_t image_size;
   uint8_t stack[8192];  // kernel stack uint32_t *next_sp /* a1 */);
+  struct cpu *cpu; // hart we run (or last ran) on. right above the kernel
+                   // stack, where the trap entries pick it up into tp
+};
+
+/*---------------- harts --------------------------------------------------*/
+
+#define HARTS_MAX 4 // harts we bring up, any others stay stopped
+#define HART_STACK_PAGES 2 // boot stack of a secondary hart, its idle thread
+
+struct spinlock {
+  uint32_t locked;
+  struct cpu *owner; // hart holding it, for catching recursion
+};
+
+// per-hart state. tp points at this hart's entry while in the kernel.
+struct cpu {
+  vaddr_t stack_top;     // boot stack, first so secondary_boot finds it
+  uint32_t hartid;
+  struct process *proc;  // what runs here now (current_proc)
+  struct process *idle;  // runs when the run queues are empty (idle_proc)
+  bool resched;          // a better process became runnable here
+  bool tlb_stale;        // ASIDs rolled over on another hart, flush all
+  uint32_t loaded_satp;  // what satp holds, kernel threads leave it alone
+  struct process *runq_head[PRIO_LEVELS]; // see runq_push
+  struct process *runq_tail[PRIO_LEVELS];
+  uint32_t runq_bitmap;
+  uint32_t runq_count;   // processes waiting here, for work stealing
 };
 
+// this hart's struct cpu
+#define this_cpu()                                                             \
+  ({                                                                           \
+    struct cpu *__cpu;                                                         \
+    __asm__ __volatile__("mv %0, tp" : "=r"(__cpu));                           \
+    __cpu;                                                                     \
+  })
+
+#define current_proc (this_cpu()->proc)
+#define idle_proc (this_cpu()->idle)
+#define need_resched (this_cpu()->resched)
+
 // globals
 
 extern struct process procs[PROCS_MAX]; // global process list
 
-struct process *create_process(const void *image, size_t image_size);
+extern struct cpu cpus[HARTS_MAX];
+extern uint32_t ncpus;             // harts up and running
+extern struct spinlock kernel_lock; // held by whichever hart is in the kernel
+extern uint32_t asid_bits;         // ASID width of the harts, 0 if none
 
-extern struct process *current_proc;
-extern struct process *idle_proc; // Idle process
+struct process *create_process(const void *image, size_t image_size);
+struct process *create_kernel_thread(void (*fn)(void *), void *arg);
+struct process *create_idle_process(void);
+struct process *spawn_process(int arg);
+paddr_t image_get_page(struct image *img, uint32_t index, bool *major);
+void sbi_send_ipi(uint32_t hartid); // kernel.c
 
 // functions
 
+void spin_lock(struct spinlock *lock);
+void spin_unlock(struct spinlock *lock);
+void lock_kernel(void);
+void unlock_kernel(void);
+struct cpu *cpu_init(uint32_t hartid);
+void asid_init(void);
+uint32_t proc_asid(struct process *proc);
+void drop_borrowed_page_table(void);
 void yield(void);
+void proc_exit(void);
+void wait_children(void);
+void preempt(void);
+int proc_nice(struct process *proc, int inc);
+void sleep_on(void *chan);
+void wakeup(void *chan);
 
 #endif // PROCESS_H_
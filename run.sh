@@ -9,23 +9,29 @@ OBJCOPY=llvm-objcopy
 # clang and compiler flags
 CC=clang
 CFLAGS="-std=c11 -O2 -g3 -Wall -Wextra --target=riscv32-unknown-elf -fno-stack-protector -ffreestanding -nostdlib"
+# BENCH=1 ./run.sh builds the kernel with the boot-time benchmarks
+if [ "${BENCH:-0}" = 1 ]; then
+  CFLAGS="$CFLAGS -DBENCH"
+fi
 
-# build the shell.
+# build the shell. the kernel loads the ELF file itself, so .bss and the
+# stack take no space in the embedded image
 $CC $CFLAGS -Wl,-Tuser.ld -Wl,-Map=shell.map -o shell.elf shell.c user.c common.c 
-$OBJCOPY --set-section-flags .bss=alloc,contents -O binary shell.elf shell.bin
-$OBJCOPY -Ibinary -Oelf32-littleriscv shell.bin shell.bin.o
+$OBJCOPY --strip-all shell.elf shell.exe
+$OBJCOPY -Ibinary -Oelf32-littleriscv shell.exe shell.exe.o
 
 # build the kernel
 $CC $CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
-  kernel.c common.c process.c shell.bin.o
+  kernel.c common.c memory.c process.c shell.exe.o
 
 # create our tar filesystem
 (cd disk && tar cf ../disk.tar --format=ustar *.txt)                          # new
 
-# Start QEMU
+# Start QEMU (add e.g. -cpu rv32,v=true,vlen=128 to try the vector memcpy).
+# SMP=n ./run.sh boots with n harts.
 
 
-$QEMU -machine virt -bios default -nographic -serial mon:stdio --no-reboot \
+$QEMU -machine virt -smp "${SMP:-1}" -bios default -nographic -serial mon:stdio --no-reboot \
     -d unimp,guest_errors,int,cpu_reset -D qemu.log \
     -drive id=drive0,file=disk.tar,format=raw,if=none \
     -device virtio-blk-device,drive=drive0,bus=virtio-mmio-bus.0 \
@@ -5,12 +5,122 @@
 
 #include "user.h"
 
+#ifdef BENCH
+uint32_t rdcycle(void) {
+  uint32_t cycles;
+  __asm__ __volatile__("rdcycle %0" : "=r"(cycles));
+  return cycles;
+}
+
+// average cycles for a null syscall, which takes the ecall fast path, and
+// for an ebreak, which the kernel bounces straight back through the full
+// register save in kernel_entry/handle_trap (the old path for every trap)
+void trap_bench(void) {
+  const uint32_t rounds = 1000;
+
+  uint32_t start = rdcycle();
+  for (uint32_t i = 0; i < rounds; i++)
+    syscall(SYS_NULL, 0, 0, 0);
+  uint32_t fast = (rdcycle() - start) / rounds;
+
+  start = rdcycle();
+  for (uint32_t i = 0; i < rounds; i++)
+    __asm__ __volatile__(".option push\n"
+                         ".option norvc\n"
+                         "ebreak\n"
+                         ".option pop\n" ::
+                             : "memory");
+  uint32_t slow = (rdcycle() - start) / rounds;
+
+  printf("trap bench: null syscall %d cycles, full trap path %d cycles\n",
+         fast, slow);
+}
+
+#define SMP_BENCH_LOOPS 20000000 // work per worker
+
+uint32_t rdtime(void) {
+  uint32_t time;
+  __asm__ __volatile__("rdtime %0" : "=r"(time));
+  return time;
+}
+
+// a spawned copy of the shell with a non-zero argument just burns cpu
+void smp_worker(void) {
+  for (volatile uint32_t i = 0; i < SMP_BENCH_LOOPS; i++)
+    ;
+}
+
+// wall-clock time for 1, 2 and 4 workers doing the same work each. with at
+// least that many harts the time stays flat as workers are added.
+void smp_bench(void) {
+  for (int workers = 1; workers <= 4; workers *= 2) {
+    uint32_t start = rdtime();
+    for (int i = 0; i < workers; i++)
+      spawn(1);
+    wait();
+    uint32_t ms = (rdtime() - start) / 10000; // qemu virt's 10MHz timebase
+    printf("smp bench: %d workers, %d ms\n", workers, ms);
+  }
+}
+
+// file round trip: overwrite the start of lorem.txt, sync, read it back,
+// then put the original bytes back. writes to the disk image, so it only
+// runs in bench builds.
+void fs_check(void) {
+  char saved[16], check[16];
+  const char pattern[16] = "sync check 0123";
+  if (fread("lorem.txt", saved, sizeof(saved)) != sizeof(saved))
+    return;
+
+  bool ok = fwrite("lorem.txt", pattern, sizeof(pattern)) == sizeof(pattern) &&
+            sync() == 0 &&
+            fread("lorem.txt", check, sizeof(check)) == sizeof(check);
+  for (size_t i = 0; ok && i < sizeof(check); i++)
+    ok = check[i] == pattern[i];
+  fwrite("lorem.txt", saved, sizeof(saved));
+  sync();
+  printf("fs check: write/sync/read back %s\n", ok ? "ok" : "FAILED");
+}
+#endif
+
 // main function of shell
 // for now we just test things with a forced page fault
-void main(void) {
+void main(int arg) {
+#ifdef BENCH
+  if (arg) {
+    smp_worker();
+    exit();
+  }
+#else
+  (void)arg;
+#endif
   //*((volatile int *)0x80200000) = 0x1234;
   printf("shell.c::main()::shell launched__\n");
+#ifdef BENCH
+  trap_bench();
+  smp_bench();
+  fs_check();
+#endif
   // putchar('a');
-  for (;;)
-    ;
+  struct bcache_stats bs;
+  if (bcache_stats(&bs) == 0)
+    printf("bcache: %d hits, %d misses, %d evictions, %d writebacks\n",
+           bs.hits, bs.misses, bs.evictions, bs.writebacks);
+
+  struct fault_stats fs;
+  if (fault_stats(&fs) == 0)
+    printf("page faults: %d major, %d minor\n", fs.major, fs.minor);
+
+  size_t len = 0;
+  const char *text = mmap("lorem.txt", &len, PROT_READ);
+  if (text)
+    printf("mmap: lorem.txt is %d bytes, starts with '%c'\n", len, text[0]);
+
+  // echo what is typed; read sleeps in the kernel until there is input
+  char line[64];
+  for (;;) {
+    int n = read(line, sizeof(line));
+    if (n > 0)
+      write(line, n);
+  }
 }
@@ -8,11 +8,6 @@
 
 extern char __stack_top[];
 
-__attribute__((noreturn)) void exit(void) {
-  for (;;)
-    ;
-}
-
 int syscall(int sysno, int arg0, int arg1, int arg2) {
   register int a0 __asm__("a0") = arg0;
   register int a1 __asm__("a1") = arg1;
@@ -27,14 +22,106 @@ int syscall(int sysno, int arg0, int arg1, int arg2) {
   return a0;
 }
 
+__attribute__((noreturn)) void exit(void) {
+  flush();
+  syscall(SYS_EXIT, 0, 0, 0);
+  for (;;) // just in case
+    ;
+}
+
 // void putchar(char ch) { /* nothing */ }
 
-void putchar(char ch) { syscall(SYS_PUTCHAR, ch, 0, 0); }
+// print len bytes from buf in one syscall, returns the bytes written or -1
+int write(const char *buf, size_t len) {
+  return syscall(SYS_WRITE, (int)buf, len, 0);
+}
+
+// wait for a key, returns the character
+int getchar(void) {
+  flush(); // whatever prompt we printed should be visible first
+  return syscall(SYS_GETCHAR, 0, 0, 0);
+}
+
+// wait for console input and take up to len characters of it at once,
+// returns the number read or -1
+int read(char *buf, size_t len) {
+  flush();
+  return syscall(SYS_READ, (int)buf, len, 0);
+}
+
+// printf and putchar collect output here and hand it to the kernel a line
+// at a time
+char out_buf[OUT_BUF_SIZE];
+size_t out_len;
+
+// push out whatever putchar has buffered
+void flush(void) {
+  if (out_len > 0)
+    write(out_buf, out_len);
+  out_len = 0;
+}
+
+void putchar(char ch) {
+  out_buf[out_len++] = ch;
+  if (ch == '\n' || out_len == sizeof(out_buf))
+    flush();
+}
+
+// lower (positive inc) or raise our scheduling priority
+// returns the new priority, 0 is the best
+int nice(int inc) { return syscall(SYS_NICE, inc, 0, 0); }
+
+// write every changed file and disk buffer back, 0 on success
+int sync(void) { return syscall(SYS_SYNC, 0, 0, 0); }
+
+// buffer cache hit/miss/eviction counters, 0 on success
+int bcache_stats(struct bcache_stats *stats) {
+  return syscall(SYS_BCACHE_STATS, (int)stats, 0, 0);
+}
+
+// copy the most recent len bytes of the kernel log into buf, returns the
+// number of bytes copied or -1
+int dmesg(char *buf, size_t len) {
+  return syscall(SYS_DMESG, (int)buf, len, 0);
+}
+
+// our major and minor page fault counts, 0 on success
+int fault_stats(struct fault_stats *stats) {
+  return syscall(SYS_FAULT_STATS, (int)stats, 0, 0);
+}
+
+// start another process running this same program, with `arg` passed to
+// its main. returns the new pid or -1.
+int spawn(int arg) { return syscall(SYS_SPAWN, arg, 0, 0); }
+
+// sleep until every process we spawned has exited
+void wait(void) { syscall(SYS_WAIT, 0, 0, 0); }
+
+// map a file into our address space. *len is the number of bytes wanted,
+// 0 for the whole file, and comes back as the length mapped. PROT_WRITE
+// mappings are private. returns NULL on failure.
+void *mmap(const char *name, size_t *len, int prot) {
+  return (void *)syscall(SYS_MMAP, (int)name, (int)len, prot);
+}
+
+// read up to len bytes from the start of a file, returns the number of
+// bytes read or -1
+int fread(const char *name, void *buf, size_t len) {
+  return syscall(SYS_FREAD, (int)name, (int)buf, len);
+}
+
+// overwrite the start of a file with len bytes, no more than its size. it
+// reaches the disk on the next sync. returns len or -1.
+int fwrite(const char *name, const void *buf, size_t len) {
+  return syscall(SYS_FWRITE, (int)name, (int)buf, len);
+}
 
-// upon entering user mode at .text.start we want to call main()
+// upon entering user mode at .text.start we want to call main(), with the
+// argument the kernel left in a0 (0 unless we were spawned with one). la so
+// the compiler cannot pick a0 for the stack top.
 __attribute__((section(".text.start"))) __attribute__((naked)) void
 start(void) {
-  __asm__ __volatile__("mv sp, %[stack_top] \n"
-                       "call main           \n"
-                       "call exit           \n" ::[stack_top] "r"(__stack_top));
+  __asm__ __volatile__("la sp, __stack_top \n"
+                       "call main          \n"
+                       "call exit          \n");
 }
@@ -6,12 +6,28 @@
 #pragma once
 #include "common.h"
 
+#define OUT_BUF_SIZE 256 // putchar buffers this much, or up to a newline
+
 struct sysret {
     int a0;
     int a1;
     int a2;
 };
 
+int syscall(int sysno, int arg0, int arg1, int arg2);
 __attribute__((noreturn)) void exit(void);
 void putchar(char ch);
+int write(const char *buf, size_t len);
+int getchar(void);
+int read(char *buf, size_t len);
+int nice(int inc);
+int sync(void);
+int bcache_stats(struct bcache_stats *stats);
+int dmesg(char *buf, size_t len);
+int fault_stats(struct fault_stats *stats);
+void *mmap(const char *name, size_t *len, int prot);
+int fread(const char *name, void *buf, size_t len);
+int fwrite(const char *name, const void *buf, size_t len);
+int spawn(int arg);
+void wait(void);
 void _u_putchar(char ch);